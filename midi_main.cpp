@@ -2,8 +2,21 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define SEND_NOTE_OFF		0b00000001
 #define SEND_NOTE_ON		0b00000010
@@ -40,7 +53,19 @@ int str_eq(const char *t1, const char *t2)
 	return 1;
 }
 
-int parse_vbl(uint8_t *buf, uint32_t *res)
+//returns the rest of str after prefix, NULL if str doesn't start with it
+const char *str_prefix(const char *str, const char *prefix)
+{
+	int x = 0;
+	while(prefix[x] != 0)
+	{
+		if(str[x] != prefix[x]) return NULL;
+		++x;
+	}
+	return str + x;
+}
+
+int parse_vbl_scalar(uint8_t *buf, uint32_t *res)
 {
 	uint32_t val = 0;
 	int pp = 0;
@@ -55,1008 +80,3844 @@ int parse_vbl(uint8_t *buf, uint32_t *res)
 	return pp+1;
 }
 
-float ticks_to_ms = 1.0;
-uint32_t ticks_per_qn = 1000;
-uint32_t micros_per_qn = 800000; 
+//same result as parse_vbl_scalar(). Most delta times are one byte, longer numbers get their length from the
+//continuation bits of 16 bytes at once and are assembled without a loop. Reads 16 bytes, the input is padded
+inline int parse_vbl(uint8_t *buf, uint32_t *res)
+{
+	if(buf[0] < 0x80)
+	{
+		*res = buf[0];
+		return 1;
+	}
+#ifdef __SSE2__
+	uint32_t ends = ~_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)buf)) & 0xFFFF; //bytes without continuation bit
+	int len = __builtin_ctz(ends | 0x10000) + 1;
+	if(len > 4) return parse_vbl_scalar(buf, res); //longer than MIDI allows
+	uint32_t w = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+	w &= 0x7F7F7F7F;
+	w = ((w & 0x7F000000) >> 3) | ((w & 0x7F0000) >> 2) | ((w & 0x7F00) >> 1) | (w & 0x7F);
+	*res = w >> (7 * (4 - len));
+	return len;
+#else
+	return parse_vbl_scalar(buf, res);
+#endif
+}
 
+typedef struct sTempoPoint
+{
+	uint32_t tick; //absolute tick where the tempo starts
+	uint32_t tempo; //microseconds per quarter note
+	uint64_t acc; //time at the point in (microseconds * ticks_per_qn), exact prefix sum of previous segments
+	int order; //insertion order, keeps the last of several points at the same tick
+}sTempoPoint;
 
-#define MAX_TEMPO_POINTS 10000
-int tempo_points = 0;
-uint32_t tempo_ms[MAX_TEMPO_POINTS];
-uint32_t tempo_value[MAX_TEMPO_POINTS];
+typedef struct sTempoMap
+{
+	sTempoPoint *points;
+	int count;
+	int size;
+}sTempoMap;
 
+//8 bytes, copied and sorted as a plain value. Events with a key (note off/on, aftertouch, controller)
+//keep it in the upper 7 bits of data and a 9 bit value below it. Other events have no key (255 in the
+//output) and a 14 bit value, pitch bend is stored as the raw 14 bit number. Use the evt_ accessors
 typedef struct sMIDI_event
 {
-	uint8_t active; //whant to turn off some events during post processing
 	uint32_t T;
-	uint8_t type;
 	uint8_t track;
-	uint8_t channel;
-	uint8_t key;
-	int value; //stores also pitch bend values
-	void set_to(sMIDI_event e)
-	{
-		active = e.active;
-		T = e.T;
-		type = e.type;
-		track = e.track;
-		channel = e.channel;
-		key = e.key;
-		value = e.value;
-	};
+	uint8_t chan_type; //channel << 4 | type
+	uint16_t data;
 }sMIDI_event;
 
-sMIDI_event *events;
-int events_count = 0;
-int events_size = 0;
-int event_count_memstep = 100;
+inline int evt_has_key(int type)
+{
+	return type <= evt_ctrl_change;
+}
+
+inline int evt_channel(const sMIDI_event *e)
+{
+	return e->chan_type >> 4;
+}
 
-int zero_to_off = 0;
+inline int evt_type(const sMIDI_event *e)
+{
+	return e->chan_type & 0x0F;
+}
 
-void add_event(sMIDI_event evt)
-{	
-	if(events_count >= events_size)
-	{
-		events_size += event_count_memstep;
-		sMIDI_event *ee = new sMIDI_event[events_size];
-		for(int x = 0; x < events_count; x++)
-			ee[x].set_to(events[x]);
-		delete events;
-		events = ee;
-	}
-	events[events_count].set_to(evt);
-	if(zero_to_off)
-		if(events[events_count].type == evt_note_on && events[events_count].value == 0) 
-		{
-			events[events_count].type = evt_note_off;
-			events[events_count].value = 64;
-		}
-	
-	events_count++;
+inline int evt_key(const sMIDI_event *e)
+{
+	return evt_has_key(evt_type(e)) ? e->data >> 9 : 255;
+}
+
+//pitch bend as (msb<<8) + lsb, the way the text output has it
+inline int evt_value(const sMIDI_event *e)
+{
+	int type = evt_type(e);
+	if(evt_has_key(type)) return e->data & 0x1FF;
+	if(type == evt_pitch_bend) return ((e->data >> 7) << 8) | (e->data & 0x7F);
+	return e->data;
+}
+
+inline void evt_set_value(sMIDI_event *e, int value)
+{
+	int type = evt_type(e);
+	if(evt_has_key(type))
+		e->data = (e->data & 0xFE00) | (value & 0x1FF);
+	else if(type == evt_pitch_bend)
+		e->data = (((value >> 8) & 0x7F) << 7) | (value & 0x7F);
+	else
+		e->data = value & 0x3FFF;
+}
+
+//keeps key and value, both types of the pairs it is used for have a key
+inline void evt_set_type(sMIDI_event *e, int type)
+{
+	e->chan_type = (e->chan_type & 0xF0) | type;
+}
+
+inline void evt_set(sMIDI_event *e, uint32_t T, int track, int channel, int type, int key, int value)
+{
+	e->T = T;
+	e->track = track;
+	e->chan_type = (channel << 4) | type;
+	e->data = evt_has_key(type) ? (key & 0x7F) << 9 : 0;
+	evt_set_value(e, value);
+}
+
+//state for every (channel, key) of the overlap resolver and the note postprocessor
+#define NOTE_SLOTS (16*128)
+
+//MTrk chunk found by parse_midi(), with the ranges its events and tempo points took in the worker's context
+typedef struct sTrackChunk
+{
+	uint8_t *data;
+	uint32_t length;
+	int track;
+	int worker;
+	int first_event;
+	int end_event;
+	int first_tempo;
+	int end_tempo;
+	int expected; //events prescan_track() counted, -1 if not known yet
+}sTrackChunk;
+
+//streaming read of one track: the next event is decoded only when the previous one was taken
+typedef struct sTrackCursor
+{
+	uint8_t *data;
+	int length;
+	int pos;
+	int track;
+	uint32_t tick;
+	uint8_t running_status;
+	int seg; //tempo map segment of tick, only moves forward, negative until the first search
+	sMIDI_event evt; //next event of the track, T in output time units
+}sTrackCursor;
+
+typedef struct sOverlapResolver
+{
+	uint8_t keys_on[NOTE_SLOTS];
+	uint8_t keys_seen[NOTE_SLOTS];
+	uint32_t keys_last_time[NOTE_SLOTS];
+	sMIDI_event *pending; //time ordered, events that cuts or shifts of later input can still land before
+	int pending_head;
+	int pending_end;
+	int pending_size;
+	void (*emit)(sMIDI_event *evt, void *arg);
+	void *emit_arg;
+}sOverlapResolver;
+
+//note postprocessor stages, bits of sNoteParams.stages
+#define POST_VELOCITY 1 //note on values remapped into low_value..high_value
+#define POST_RELEASE 2 //release of a note pressed again soon after is moved earlier
+#define POST_BOOST 4 //notes shortened that way get louder
+#define POST_HOLD 8 //note on with hold_value some time after the press of a longer note
+
+typedef struct sNoteParams
+{
+	int stages;
+	int low_value;
+	int high_value;
+	float key_coeffs[128];
+	float key_shifts[128];
+	uint32_t min_note_gap; //intervals in milliseconds
+	uint32_t min_note_length;
+	uint32_t note_on_to_hold;
+	int split_release_percent;
+	float short_note_mult;
+	int hold_value;
+}sNoteParams;
+
+typedef struct sPostEvent
+{
+	sMIDI_event evt;
+	uint32_t seq; //input order, events of the same time and track keep it
+}sPostEvent;
+
+//note waiting for its release or the next press of its key
+typedef struct sPostWait
+{
+	uint32_t T;
+	uint32_t seq;
+	int slot;
+}sPostWait;
+
+#define POST_KEY_IDLE 0
+#define POST_KEY_WAIT_UP 1
+#define POST_KEY_WAIT_DOWN 2
+
+typedef struct sNotePipeline
+{
+	sNoteParams params; //intervals in output time units
+	uint8_t state[NOTE_SLOTS]; //POST_KEY_
+	sPostEvent on[NOTE_SLOTS]; //note on of the waiting note of the key
+	sPostEvent up[NOTE_SLOTS]; //and its release
+	sPostWait *waits; //in note on order, the first one still waiting holds back the output
+	int waits_head;
+	int waits_end;
+	int waits_size;
+	sPostEvent *heap; //reorder heap of finished events
+	int heap_count;
+	int heap_size;
+	uint32_t seq;
+	uint32_t now; //time of the last input event
+	uint32_t max_wait; //NOTE_MAX_WAIT in output time units
+	void (*emit)(sMIDI_event *evt, void *arg);
+	void *emit_arg;
+}sNotePipeline;
+
+//buffered output, text is formatted straight into the buffer and written out in large blocks
+#define OUT_BUF_SIZE (1<<20)
+#define OUT_MAX_RECORD 256
+
+typedef struct sOutBuf
+{
+	int handle;
+	char *buf;
+	int len;
+	int failed;
+}sOutBuf;
+
+typedef struct sInputFile
+{
+	uint8_t *buf;
+	int length;
+	int mapped; //buf is a mapping of map_length bytes, not the heap buffer
+	size_t map_length;
+	uint8_t *heap; //buffer for input that can't be mapped, kept between files
+	int heap_size;
+}sInputFile;
+
+//parser looks a few bytes past the message it handles, so the end of input is followed by zeros
+#define FILE_TAIL_PADDING 64
+
+//selection of events for output, an event is selected when every predicate matches
+typedef struct sEventQuery
+{
+	uint32_t tracks[8]; //bit per track
+	uint16_t channels; //bit per channel
+	uint16_t types; //bit per event type, same bits as SEND_
+	uint8_t key_min; //keyless events have key 255
+	uint8_t key_max;
+	uint32_t time_min; //time window, output time units
+	uint32_t time_max;
+}sEventQuery;
+
+//query_select() state: column copies of the event fields the query tests, taken when it runs. The events
+//array stays the store, only the fields a predicate needs are copied and nothing when all events are selected
+typedef struct sQuerySnapshot
+{
+	uint32_t *T;
+	uint8_t *track;
+	uint8_t *channel;
+	uint8_t *type;
+	uint8_t *key;
+	int count;
+	int size;
+	uint32_t *selection; //bit per event, result of the last query
+}sQuerySnapshot;
+
+//last playback, see play_events()
+typedef struct sPlayStats
+{
+	int64_t start_ns; //monotonic clock at the time of the first event
+	uint32_t first_T;
+	int events;
+	int late; //sent after their time, not only after the lookahead
+	int frames; //binary protocol only
+	int resent;
+	int64_t bytes;
+	int64_t *jitter; //per event, ns the send was after its planned time
+	int jitter_size;
+}sPlayStats;
+
+//state of one parse, several contexts can be used at once from different threads. Buffers
+//only grow and are kept by parser_reset(), so a context reused for many files stops allocating
+typedef struct sParserContext
+{
+	sMIDI_event *events;
+	int events_count;
+	int events_size;
+	int zero_to_off;
+	int threads; //parse_midi() parses tracks on this many threads when there are several tracks
+	uint32_t track_set[8]; //bit per track to take events from, other tracks are read for tempo events only
+
+	//all timing is integer: microseconds from the tempo map or the SMPTE rate, then divided by time_unit
+	uint32_t time_unit; //microseconds per output time unit, 1000 for milliseconds, 1 for microseconds
+	uint32_t ticks_per_qn;
+	uint32_t smpte_num; //SMPTE timing only, microseconds = tick * smpte_num / smpte_den
+	uint32_t smpte_den;
+	int tempo_fixed;
+	int time_overflow; //some time didn't fit in 32 bits of output units and was clamped
+	sTempoMap tempo_map;
+
+	sTrackChunk *chunks;
+	int chunks_size;
+	sTrackCursor *cursors;
+	int cursors_size;
+
+	//scratch of sort_events() and process_overlaps()
+	sMIDI_event *events_tmp;
+	int events_tmp_size;
+	int events_tmp_count;
+	int *run_start;
+	int *run_end;
+	int run_size;
+	int *merge_heap;
+	int heap_size;
+	sOverlapResolver overlap;
+	sNotePipeline post;
+
+	//buffers of the last file, reused for the next one
+	sInputFile in;
+	sOutBuf out;
+	uint8_t *bin_buf; //binary output is built here and written at once
+	int bin_size;
+	sQuerySnapshot snapshot;
+	sPlayStats play;
+	struct sParserContext *workers; //contexts of parse_tracks_parallel() threads
+	struct sTrackWorker *track_workers; //their thread state, as many as workers
+	int workers_size;
+}sParserContext;
+
+#define EVENTS_MIN_ALLOC 1024
+
+void parser_init(sParserContext *ctx)
+{
+	memset(ctx, 0, sizeof(sParserContext));
+	ctx->threads = 1;
+	memset(ctx->track_set, 0xFF, sizeof(ctx->track_set));
+	ctx->time_unit = 1000;
+	ctx->ticks_per_qn = 1000;
+	ctx->smpte_num = 1000;
+	ctx->smpte_den = 1;
+}
+
+//prepares the context for the next file, all buffers are kept for reuse
+void parser_reset(sParserContext *ctx)
+{
+	ctx->events_count = 0;
+	ctx->events_tmp_count = 0;
+	ctx->tempo_map.count = 0;
+	ctx->ticks_per_qn = 1000;
+	ctx->smpte_num = 1000;
+	ctx->smpte_den = 1;
+	ctx->tempo_fixed = 0;
+	ctx->time_overflow = 0;
+}
+
+void overlap_free(sOverlapResolver *r);
+void post_free(sNotePipeline *pp);
+void out_free(sOutBuf *ob);
+void file_free(sInputFile *in);
+void snapshot_free(sQuerySnapshot *c);
+void track_workers_free(struct sTrackWorker *tw);
+
+void parser_free(sParserContext *ctx)
+{
+	delete[] ctx->events;
+	delete[] ctx->tempo_map.points;
+	delete[] ctx->chunks;
+	delete[] ctx->cursors;
+	delete[] ctx->events_tmp;
+	delete[] ctx->run_start;
+	delete[] ctx->run_end;
+	delete[] ctx->merge_heap;
+	overlap_free(&ctx->overlap);
+	post_free(&ctx->post);
+	file_free(&ctx->in);
+	out_free(&ctx->out);
+	delete[] ctx->bin_buf;
+	snapshot_free(&ctx->snapshot);
+	delete[] ctx->play.jitter;
+	for(int w = 0; w < ctx->workers_size; w++)
+		parser_free(ctx->workers + w);
+	delete[] ctx->workers;
+	track_workers_free(ctx->track_workers);
+	parser_init(ctx);
+}
+
+//grows the events array to hold at least count events, sMIDI_event is a plain struct so it's moved with memcpy
+void reserve_events(sParserContext *ctx, int count)
+{
+	if(count <= ctx->events_size) return;
+	sMIDI_event *ee = new sMIDI_event[count];
+	if(ctx->events_count > 0)
+		memcpy(ee, ctx->events, ctx->events_count * sizeof(sMIDI_event));
+	delete[] ctx->events;
+	ctx->events = ee;
+	ctx->events_size = count;
+}
+
+//events_tmp holds the result of a pass over all events and becomes the events array
+void swap_events_tmp(sParserContext *ctx)
+{
+	sMIDI_event *ee = ctx->events;
+	ctx->events = ctx->events_tmp;
+	ctx->events_tmp = ee;
+	int sz = ctx->events_size;
+	ctx->events_size = ctx->events_tmp_size;
+	ctx->events_tmp_size = sz;
+}
+
+//merge order: time, then track, then position in the array
+inline int event_before(sParserContext *ctx, int n1, int n2)
+{
+	uint64_t k1 = ((uint64_t)ctx->events[n1].T << 8) | ctx->events[n1].track;
+	uint64_t k2 = ((uint64_t)ctx->events[n2].T << 8) | ctx->events[n2].track;
+	if(k1 != k2) return k1 < k2;
+	return n1 < n2;
 }
 
-void sort_events()
+//events come from parse_track() as one time ordered run per track, postprocessing appends new events
+//or moves some times - so the array is split into runs that are already in order and these are merged.
+//Merge goes into events_tmp, which is swapped with events after it
+void sort_events(sParserContext *ctx)
 {
-	for(int n = 0; n < events_count; n++)
+	int runs = 0;
+	for(int n = 0; n < ctx->events_count; n++)
 	{
-		for(int n2 = n+1; n2 < events_count; n2++)
+		if(n > 0 && event_before(ctx, n-1, n)) continue;
+		if(runs+1 >= ctx->run_size)
 		{
-			if(events[n2].T < events[n].T)
-			{
-				sMIDI_event ee;
-				ee.set_to(events[n]);
-				events[n].set_to(events[n2]);
-				events[n2].set_to(ee);
-			}
+			ctx->run_size = ctx->run_size ? ctx->run_size*2 : 256;
+			int *rr = new int[ctx->run_size];
+			for(int x = 0; x < runs; x++)
+				rr[x] = ctx->run_start[x];
+			delete[] ctx->run_start;
+			ctx->run_start = rr;
+			delete[] ctx->run_end;
+			ctx->run_end = new int[ctx->run_size];
 		}
+		ctx->run_start[runs++] = n;
 	}
-}
+	if(runs < 2) return;
+	ctx->run_start[runs] = ctx->events_count;
 
-void process_overlaps(int overlap_master)
-{
-//	printf("overlaps:\n");
-	uint8_t keys_on[255];
-	int keys_last_time[255];
-	for(int x = 0; x < 255; x++)
+	if(ctx->events_tmp_size < ctx->events_size)
 	{
-		keys_on[x] = 0;
-		keys_last_time[x] = -1;
+		delete[] ctx->events_tmp;
+		ctx->events_tmp_size = ctx->events_size;
+		ctx->events_tmp = new sMIDI_event[ctx->events_tmp_size];
 	}
-	int cur_events_count = events_count;
-	for(int n = 0; n < cur_events_count; n++)
+	if(ctx->heap_size < runs)
 	{
-		sMIDI_event *evt = events+n;
-		if(evt->type < 2)
-		{
-			if(evt->T - keys_last_time[evt->key] < 1)
-			{
-				evt->T++; //potentially can lead to wrong events order in the output, but practically unlikely
-//				printf("shifted at %d\n", evt->T);
-			}
-			keys_last_time[evt->key] = evt->T;
-		}
-		if(evt->type == 1 && evt->value > 0)
+		delete[] ctx->merge_heap;
+		ctx->heap_size = ctx->run_size;
+		ctx->merge_heap = new int[ctx->heap_size];
+	}
+
+	//binary heap of run ids, run_start[] of each run is its current head
+	int *run_end = ctx->run_end;
+	int hcount = 0;
+	for(int r = 0; r < runs; r++)
+	{
+		run_end[r] = ctx->run_start[r+1];
+		int c = hcount++;
+		while(c > 0)
 		{
-			if(keys_on[evt->key])
-			{
-				sMIDI_event e2;
-				e2.set_to(*evt);
-				e2.type = evt_note_off;
-				e2.value = 0;
-				e2.T = evt->T-1;
-				add_event(e2);
-//				if(evt->track == overlap_master)
-//					keys_on[evt->key]++;
-//				evt->active = 0;
-//				printf("inserted cut at %d\n", e2.T);
-			}
-			keys_on[evt->key] = 1;
+			int p = (c-1) >> 1;
+			if(!event_before(ctx, ctx->run_start[r], ctx->run_start[ctx->merge_heap[p]])) break;
+			ctx->merge_heap[c] = ctx->merge_heap[p];
+			c = p;
 		}
-		if(evt->type == 0 || evt->value == 0)
+		ctx->merge_heap[c] = r;
+	}
+
+	int out = 0;
+	while(hcount > 0)
+	{
+		int r = ctx->merge_heap[0];
+		ctx->events_tmp[out++] = ctx->events[ctx->run_start[r]];
+		ctx->run_start[r]++;
+		if(ctx->run_start[r] == run_end[r])
+			r = ctx->merge_heap[--hcount];
+		if(hcount == 0) break;
+		//sift the run down from the root
+		int c = 0;
+		while(1)
 		{
-//			if(keys_on[evt->key] > 1)
-//			{ 
-//				keys_on[evt->key]--;
-//				evt->active = 0;
-//				printf("cut at %d\n", evt->T);
-//			}
-//			else keys_on[evt->key] = 0;
-			if(keys_on[evt->key] == 0) evt->active = 0;
-			keys_on[evt->key] = 0;
+			int ch = 2*c + 1;
+			if(ch >= hcount) break;
+			if(ch+1 < hcount && event_before(ctx, ctx->run_start[ctx->merge_heap[ch+1]], ctx->run_start[ctx->merge_heap[ch]])) ch++;
+			if(!event_before(ctx, ctx->run_start[ctx->merge_heap[ch]], ctx->run_start[r])) break;
+			ctx->merge_heap[c] = ctx->merge_heap[ch];
+			c = ch;
 		}
+		ctx->merge_heap[c] = r;
 	}
-	sort_events();
+	swap_events_tmp(ctx);
+}
+
+inline int note_slot(int channel, int key)
+{
+	return (channel<<7) | (key&0x7F);
+}
+
+inline int is_keyup(sMIDI_event *e)
+{
+	return evt_type(e) == evt_note_off || (evt_type(e) == evt_note_on && evt_value(e) == 0);
+}
+
+inline int is_keydown(sMIDI_event *e)
+{
+	return evt_type(e) == evt_note_on && evt_value(e) > 0;
 }
 
-int get_next_keyup(uint32_t cur_time, int key)
+//room for one more item at the end of an array that is consumed from the head, items are plain structs.
+//A mostly full array is doubled, otherwise the items are moved to its start
+template<typename T> void fifo_make_room(T **items, int *head, int *end, int *size)
 {
-	uint32_t min_ok_time = 0xFFFFFFFF;
-	int id = -1;
-	for(int n = 0; n < events_count; n++)
+	if(*end < *size) return;
+	int cnt = *end - *head;
+	if(cnt*2 >= *size)
 	{
-		if(!events[n].active) continue;
-		if(events[n].key == key && events[n].T > cur_time && events[n].T < min_ok_time)
-		{
-			if(events[n].type == evt_note_off || (events[n].type == evt_note_on && events[n].value == 0))
-			{
-				min_ok_time = events[n].T;
-				id = n;
-			}
-		}
+		*size = *size ? *size*2 : 64;
+		T *ii = new T[*size];
+		if(cnt > 0) memcpy(ii, *items + *head, cnt*sizeof(T));
+		delete[] *items;
+		*items = ii;
+	}
+	else
+		memmove(*items, *items + *head, cnt*sizeof(T));
+	*head = 0;
+	*end = cnt;
+}
+
+//overlap resolver: streaming stage over time ordered events. Shifts note events that hit the same
+//millisecond on the same key, cuts a sounding note before it's pressed again and drops releases of
+//keys that are not pressed. Output goes to emit() in time order, without resorting.
+//The pending buffer is kept between runs, the resolver has to be zeroed once before the first run
+
+void overlap_init(sOverlapResolver *r, void (*emit)(sMIDI_event *evt, void *arg), void *emit_arg)
+{
+	memset(r->keys_on, 0, sizeof(r->keys_on));
+	memset(r->keys_seen, 0, sizeof(r->keys_seen));
+	r->pending_head = r->pending_end = 0;
+	r->emit = emit;
+	r->emit_arg = emit_arg;
+}
+
+void overlap_free(sOverlapResolver *r)
+{
+	delete[] r->pending;
+	r->pending = NULL;
+	r->pending_size = 0;
+}
+
+void overlap_hold(sOverlapResolver *r, sMIDI_event *evt)
+{
+	fifo_make_room(&r->pending, &r->pending_head, &r->pending_end, &r->pending_size);
+	//same order as event_before(): time, then track, then arrival
+	uint64_t key = ((uint64_t)evt->T << 8) | evt->track;
+	int n = r->pending_end++;
+	while(n > r->pending_head && (((uint64_t)r->pending[n-1].T << 8) | r->pending[n-1].track) > key)
+	{
+		r->pending[n] = r->pending[n-1];
+		n--;
 	}
-	return id;
+	r->pending[n] = *evt;
+}
+
+//passes on everything before time T
+void overlap_release(sOverlapResolver *r, uint32_t T)
+{
+	while(r->pending_head < r->pending_end && r->pending[r->pending_head].T < T)
+		r->emit(r->pending + r->pending_head++, r->emit_arg);
 }
 
-int get_next_keydown(uint32_t cur_time, int key)
+//events have to come in time order
+void overlap_push(sOverlapResolver *r, sMIDI_event evt)
 {
-	uint32_t min_ok_time = 0xFFFFFFFF;
-	int id = -1;
-	for(int n = 0; n < events_count; n++)
+	//output of an input at time T lands within [T-1, T+1]
+	if(evt.T > 1) overlap_release(r, evt.T-1);
+	if(evt_type(&evt) != evt_note_on && evt_type(&evt) != evt_note_off)
+	{
+		overlap_hold(r, &evt);
+		return;
+	}
+	int slot = note_slot(evt_channel(&evt), evt_key(&evt));
+	if(r->keys_seen[slot] && evt.T == r->keys_last_time[slot])
+		evt.T++;
+	r->keys_seen[slot] = 1;
+	r->keys_last_time[slot] = evt.T;
+
+	if(is_keydown(&evt))
 	{
-		if(!events[n].active) continue;
-		if(events[n].key == key && events[n].T > cur_time && events[n].T < min_ok_time)
+		if(r->keys_on[slot])
 		{
-			if(events[n].type == evt_note_on && events[n].value > 0)
-			{
-				min_ok_time = events[n].T;
-				id = n;
-			}
+			sMIDI_event cut = evt;
+			evt_set_type(&cut, evt_note_off);
+			evt_set_value(&cut, 0);
+			if(cut.T > 0) cut.T--;
+			overlap_hold(r, &cut);
 		}
+		r->keys_on[slot] = 1;
+		overlap_hold(r, &evt);
+	}
+	else
+	{
+		if(r->keys_on[slot])
+			overlap_hold(r, &evt);
+		r->keys_on[slot] = 0;
+	}
+}
+
+void overlap_finish(sOverlapResolver *r)
+{
+	overlap_release(r, 0xFFFFFFFF);
+	while(r->pending_head < r->pending_end)
+		r->emit(r->pending + r->pending_head++, r->emit_arg);
+}
+
+void emit_to_events_tmp(sMIDI_event *evt, void *arg)
+{
+	sParserContext *ctx = (sParserContext*)arg;
+	if(ctx->events_tmp_count >= ctx->events_tmp_size)
+	{
+		ctx->events_tmp_size = ctx->events_tmp_size ? ctx->events_tmp_size*2 : EVENTS_MIN_ALLOC;
+		sMIDI_event *ee = new sMIDI_event[ctx->events_tmp_size];
+		if(ctx->events_tmp_count > 0) memcpy(ee, ctx->events_tmp, ctx->events_tmp_count * sizeof(sMIDI_event));
+		delete[] ctx->events_tmp;
+		ctx->events_tmp = ee;
 	}
-	return id;
+	ctx->events_tmp[ctx->events_tmp_count++] = *evt;
+}
+
+//events have to be sorted, stay sorted after it
+void process_overlaps(sParserContext *ctx, int overlap_master)
+{
+	ctx->events_tmp_count = 0;
+	overlap_init(&ctx->overlap, emit_to_events_tmp, ctx);
+	for(int n = 0; n < ctx->events_count; n++)
+		overlap_push(&ctx->overlap, ctx->events[n]);
+	overlap_finish(&ctx->overlap);
+
+	ctx->events_count = ctx->events_tmp_count;
+	swap_events_tmp(ctx);
 }
 
-//all intervals in milliseconds
+//all intervals in milliseconds, the defaults of sNoteParams
 #define MIN_NOTE_LENGTH 90
 #define MIN_NOTE_GAP 80
-#define MULTIPLIER_SPLIT_RELEASE_TIME 0.68
+#define SPLIT_RELEASE_PERCENT 68 //release of a note followed closely by the next one is moved to 100-68% of the distance
 #define SHORT_NOTE_MULT 2.0
 
 #define NOTE_LOW_VALUE 135
 #define NOTE_HIGH_VALUE 155
 #define NOTE_HOLD_VALUE 75
 #define NOTE_ON_TO_HOLD 90
+//a note held longer is resolved without waiting for its release, which then passes unchanged. It bounds
+//how much output a stuck note holds back
+#define NOTE_MAX_WAIT 4000
+
+void note_params_init(sNoteParams *p)
+{
+	p->stages = POST_VELOCITY | POST_RELEASE | POST_BOOST | POST_HOLD;
+	p->low_value = NOTE_LOW_VALUE;
+	p->high_value = NOTE_HIGH_VALUE;
+	for(int x = 0; x < 128; x++)
+	{
+		p->key_coeffs[x] = 1.0;
+		p->key_shifts[x] = 0.0;
+	}
+	p->min_note_gap = MIN_NOTE_GAP;
+	p->min_note_length = MIN_NOTE_LENGTH;
+	p->note_on_to_hold = NOTE_ON_TO_HOLD;
+	p->split_release_percent = SPLIT_RELEASE_PERCENT;
+	p->short_note_mult = SHORT_NOTE_MULT;
+	p->hold_value = NOTE_HOLD_VALUE;
+}
 
-float key_coeffs[150];
-float key_shifts[150];
+//note postprocessor: streaming stages over time ordered events in one sweep. A note on waits for its
+//release, at most NOTE_MAX_WAIT, and with POST_RELEASE for the next press of the key, at most min_note_gap
+//after the release.
+//Finished events go to a reorder heap and are emitted once no waiting note can put anything before
+//them, in the order sort_events() would give. Input has to be free of overlaps, see overlap_push().
+//Buffers are kept between runs, the pipeline has to be zeroed once before the first run
+
+void post_init(sNotePipeline *pp, const sNoteParams *params, uint32_t time_unit, void (*emit)(sMIDI_event *evt, void *arg), void *emit_arg)
+{
+	pp->params = *params;
+	uint32_t unit_ms = 1000 / time_unit;
+	pp->params.min_note_gap *= unit_ms;
+	pp->params.min_note_length *= unit_ms;
+	pp->params.note_on_to_hold *= unit_ms;
+	pp->max_wait = NOTE_MAX_WAIT * unit_ms;
+	if(pp->max_wait <= pp->params.note_on_to_hold) pp->max_wait = pp->params.note_on_to_hold + 1;
+	memset(pp->state, POST_KEY_IDLE, sizeof(pp->state));
+	pp->waits_head = pp->waits_end = 0;
+	pp->heap_count = 0;
+	pp->seq = 0;
+	pp->now = 0;
+	pp->emit = emit;
+	pp->emit_arg = emit_arg;
+}
+
+void post_free(sNotePipeline *pp)
+{
+	delete[] pp->waits;
+	delete[] pp->heap;
+	pp->waits = NULL;
+	pp->heap = NULL;
+	pp->waits_size = pp->heap_size = 0;
+}
+
+inline int post_before(const sPostEvent *a, const sPostEvent *b)
+{
+	if(a->evt.T != b->evt.T) return a->evt.T < b->evt.T;
+	if(a->evt.track != b->evt.track) return a->evt.track < b->evt.track;
+	return a->seq < b->seq;
+}
 
-void init_volume_coeffs()
+void post_heap_push(sNotePipeline *pp, const sPostEvent *pe)
 {
-	for(int x = 0; x < 150; x++)
+	if(pp->heap_count >= pp->heap_size)
+	{
+		pp->heap_size = pp->heap_size ? pp->heap_size*2 : 256;
+		sPostEvent *hh = new sPostEvent[pp->heap_size];
+		if(pp->heap_count > 0) memcpy(hh, pp->heap, pp->heap_count * sizeof(sPostEvent));
+		delete[] pp->heap;
+		pp->heap = hh;
+	}
+	int c = pp->heap_count++;
+	while(c > 0 && post_before(pe, pp->heap + (c-1)/2))
 	{
-		key_coeffs[x] = 1.0;
-		key_shifts[x] = 0.0;
+		pp->heap[c] = pp->heap[(c-1)/2];
+		c = (c-1)/2;
 	}
+	pp->heap[c] = *pe;
 }
-void process_volume()
+
+//emits the finished events before time T
+void post_release(sNotePipeline *pp, uint64_t T)
 {
-	float vmin = NOTE_LOW_VALUE;
-	float range = NOTE_HIGH_VALUE - NOTE_LOW_VALUE;
-	for(int n = 0; n < events_count; n++)
+	while(pp->heap_count > 0 && pp->heap[0].evt.T < T)
 	{
-		if(!events[n].active) continue;
-		if(events[n].type == evt_note_on)
+		pp->emit(&pp->heap[0].evt, pp->emit_arg);
+		sPostEvent last = pp->heap[--pp->heap_count];
+		int c = 0;
+		while(1)
 		{
-			float val = events[n].value;
-			val /= 255.0;
-			val *= key_coeffs[events[n].key];
-			val = vmin + val*range + key_shifts[events[n].key];
-			events[n].value = val;
+			int ch = 2*c + 1;
+			if(ch >= pp->heap_count) break;
+			if(ch+1 < pp->heap_count && post_before(pp->heap + ch+1, pp->heap + ch)) ch++;
+			if(!post_before(pp->heap + ch, &last)) break;
+			pp->heap[c] = pp->heap[ch];
+			c = ch;
 		}
+		pp->heap[c] = last;
 	}
 }
 
-void note_postprocessor()
+void post_wait(sNotePipeline *pp, int slot)
+{
+	fifo_make_room(&pp->waits, &pp->waits_head, &pp->waits_end, &pp->waits_size);
+	sPostWait *w = pp->waits + pp->waits_end++;
+	w->T = pp->on[slot].evt.T;
+	w->seq = pp->on[slot].seq;
+	w->slot = slot;
+}
+
+void post_hold(sNotePipeline *pp, const sPostEvent *on)
+{
+	if(!(pp->params.stages & POST_HOLD)) return;
+	sPostEvent hold = *on;
+	hold.evt.T += pp->params.note_on_to_hold;
+	evt_set_value(&hold.evt, pp->params.hold_value);
+	hold.seq |= 0x80000000; //after all input events, as if appended
+	post_heap_push(pp, &hold);
+}
+
+//the waiting note of the key is done, down is the next press or NULL
+void post_resolve(sNotePipeline *pp, int slot, const sPostEvent *down)
 {
-	init_volume_coeffs();
-	process_volume();
-	for(int n = 0; n < events_count; n++)
+	sNoteParams *p = &pp->params;
+	sPostEvent *on = pp->on + slot;
+	sPostEvent *up = pp->up + slot;
+	if(pp->state[slot] == POST_KEY_WAIT_DOWN)
 	{
-		if(!events[n].active) continue;
-		if(events[n].type == evt_note_on)
+		if(down && (p->stages & POST_RELEASE) && down->evt.T - up->evt.T < p->min_note_gap)
 		{
-			int up = get_next_keyup(events[n].T, events[n].key);
-			if(up < 0) continue;
-			int down = get_next_keydown(events[up].T, events[up].key);
-			if(down < 0) continue;
-			uint32_t gap = events[down].T - events[up].T;
-			double dt = events[down].T - events[n].T;
-			if(gap < MIN_NOTE_GAP)
+			uint64_t dt = down->evt.T - on->evt.T;
+			up->evt.T = on->evt.T + dt * (100 - p->split_release_percent) / 100;
+			uint32_t len = up->evt.T - on->evt.T;
+			if((p->stages & POST_BOOST) && len < p->min_note_length) //subject to volume increase
 			{
-				events[up].T = events[n].T + (1.0-MULTIPLIER_SPLIT_RELEASE_TIME)*dt;
-				uint32_t len = events[up].T - events[n].T;
-				if(len < MIN_NOTE_LENGTH) //subject to volume increase
-				{
-					float coeff = (double)len / (double)MIN_NOTE_LENGTH;
-					float val = events[n].value - NOTE_LOW_VALUE;
-					val *= SHORT_NOTE_MULT * (1.0 - coeff)*(1.0 - coeff);
-					val += NOTE_LOW_VALUE;
-					if(val > 255) val = 255;
-					events[n].value = val;
-				}
+				float coeff = (double)len / (double)p->min_note_length;
+				float val = evt_value(&on->evt) - p->low_value;
+				val *= p->short_note_mult * (1.0 - coeff)*(1.0 - coeff);
+				val += p->low_value;
+				if(val > 255) val = 255;
+				evt_set_value(&on->evt, val);
 			}
 		}
+		if(up->evt.T > on->evt.T + p->note_on_to_hold)
+			post_hold(pp, on);
+		post_heap_push(pp, up);
 	}
-	
-	int cur_events_count = events_count;
-	for(int n = 0; n < cur_events_count; n++)
+	post_heap_push(pp, on);
+	pp->state[slot] = POST_KEY_IDLE;
+}
+
+//drops finished notes from the front of the waits and ends the ones that can't be pressed again in time.
+//Returns the time before which all output is final
+uint32_t post_expire(sNotePipeline *pp)
+{
+	while(pp->waits_head < pp->waits_end)
 	{
-		if(!events[n].active) continue;
-		if(events[n].type == evt_note_on && events[n].value > 0)
+		sPostWait *w = pp->waits + pp->waits_head;
+		if(pp->state[w->slot] == POST_KEY_IDLE || pp->on[w->slot].seq != w->seq)
 		{
-			int up = get_next_keyup(events[n].T, events[n].key);
-			if(up < 0)
-				continue;
-			if(events[up].T > events[n].T + NOTE_ON_TO_HOLD)
-			{
-				sMIDI_event evt;
-				evt.set_to(events[n]);
-				evt.T = events[n].T + NOTE_ON_TO_HOLD;
-				evt.value = NOTE_HOLD_VALUE;
-				add_event(evt);
-			}
+			pp->waits_head++;
+			continue;
+		}
+		if(pp->state[w->slot] == POST_KEY_WAIT_DOWN && pp->now - pp->up[w->slot].evt.T >= pp->params.min_note_gap)
+		{
+			post_resolve(pp, w->slot, NULL);
+			pp->waits_head++;
+			continue;
+		}
+		if(pp->state[w->slot] == POST_KEY_WAIT_UP && pp->now - w->T >= pp->max_wait)
+		{
+			//the release comes after now, so it's longer than note_on_to_hold
+			post_hold(pp, pp->on + w->slot);
+			post_resolve(pp, w->slot, NULL);
+			pp->waits_head++;
+			continue;
 		}
+		return w->T;
 	}
-	sort_events();
+	return pp->now;
 }
 
-void save_python_script(char *fname, uint64_t track_mask)
+//events have to come in time order
+void post_push(sNotePipeline *pp, sMIDI_event evt)
 {
-	int handle = open(fname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-	
-	if(handle < 1)
+	sNoteParams *p = &pp->params;
+	sPostEvent pe;
+	pe.evt = evt;
+	pe.seq = pp->seq++;
+	pp->now = evt.T;
+	if((p->stages & POST_VELOCITY) && evt_type(&pe.evt) == evt_note_on)
 	{
-		fprintf(stderr, "can't open/create output file %s\n", fname);
-		return;
+		int key = evt_key(&pe.evt);
+		float val = evt_value(&pe.evt);
+		val /= 255.0;
+		val *= p->key_coeffs[key];
+		val = p->low_value + val*(p->high_value - p->low_value) + p->key_shifts[key];
+		evt_set_value(&pe.evt, val);
 	}
-	
-	char tbuf[1024];
-	int len;
 
-	len = sprintf(tbuf, "import serial\n");
-	len += sprintf(tbuf+len, "import time\n");
-	len += sprintf(tbuf+len, "ser = serial.Serial('COM3', 115200, timeout=5)\n");
-	len += sprintf(tbuf+len, "time.sleep(3)\n\n");
-	len += sprintf(tbuf+len, "#<timestamp,track,channel,event,note,midipower>\n");
-	len += sprintf(tbuf+len, "ser.write('<0,0,0,8,0,0>')\n");
-	write(handle, tbuf, len);
-	for(int x = 0; x < events_count; x++)
-	{
-		if(!((1<<events[x].track) & track_mask)) continue;
-		if(!events[x].active) continue;
-		
-		int len;
-		len = sprintf(tbuf, "ser.write('<%d,%d,%d,%d,%d,%d>')\nser.readline()\n", events[x].T, events[x].track, events[x].channel, events[x].type, events[x].key, events[x].value);
-		if(write(handle, tbuf, len) < len)
-			fprintf(stderr, "write %d bytes failed\n", len);
+	int slot = note_slot(evt_channel(&pe.evt), evt_key(&pe.evt));
+	if(!(p->stages & (POST_RELEASE | POST_HOLD)))
+		post_heap_push(pp, &pe);
+	else if(is_keydown(&pe.evt))
+	{
+		if(pp->state[slot] != POST_KEY_IDLE)
+			post_resolve(pp, slot, &pe);
+		pp->on[slot] = pe;
+		pp->state[slot] = POST_KEY_WAIT_UP;
+		post_wait(pp, slot);
+	}
+	else if(is_keyup(&pe.evt) && pp->state[slot] == POST_KEY_WAIT_UP)
+	{
+		pp->up[slot] = pe;
+		pp->state[slot] = POST_KEY_WAIT_DOWN;
+		if(!(p->stages & POST_RELEASE))
+			post_resolve(pp, slot, NULL);
+	}
+	else
+		post_heap_push(pp, &pe);
+	post_release(pp, post_expire(pp));
+}
 
+void post_finish(sNotePipeline *pp)
+{
+	for(int n = pp->waits_head; n < pp->waits_end; n++)
+	{
+		sPostWait *w = pp->waits + n;
+		if(pp->state[w->slot] != POST_KEY_IDLE && pp->on[w->slot].seq == w->seq)
+			post_resolve(pp, w->slot, NULL);
 	}
-	close(handle);
+	pp->waits_head = pp->waits_end = 0;
+	post_release(pp, (uint64_t)1 << 32);
 }
 
+void emit_to_post(sMIDI_event *evt, void *arg)
+{
+	post_push((sNotePipeline*)arg, *evt);
+}
 
-void save_events(char *fname, uint64_t track_mask)
+//events have to be sorted, stay sorted after it. With prevent_overlap the overlap resolver runs in the same sweep
+void note_postprocessor(sParserContext *ctx, const sNoteParams *params, int prevent_overlap)
 {
-	int handle = open(fname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-	
-	if(handle < 1)
+	ctx->events_tmp_count = 0;
+	post_init(&ctx->post, params, ctx->time_unit, emit_to_events_tmp, ctx);
+	if(prevent_overlap)
+		overlap_init(&ctx->overlap, emit_to_post, &ctx->post);
+	for(int n = 0; n < ctx->events_count; n++)
 	{
-		fprintf(stderr, "can't open/create output file %s\n", fname);
-		return;
+		if(prevent_overlap)
+			overlap_push(&ctx->overlap, ctx->events[n]);
+		else
+			post_push(&ctx->post, ctx->events[n]);
 	}
-	
-	char tbuf[1024];
-	for(int x = 0; x < events_count; x++)
-	{
-		if(!((1<<events[x].track) & track_mask)) continue;
-		if(!events[x].active) continue;
-		
-		int len;
-		len = sprintf(tbuf, "%d,%d,%d,%d,%d,%d\n", events[x].T, events[x].track, events[x].channel, events[x].type, events[x].key, events[x].value);
-		if(write(handle, tbuf, len) < len)
-			fprintf(stderr, "write %d bytes failed\n", len);
+	if(prevent_overlap)
+		overlap_finish(&ctx->overlap);
+	post_finish(&ctx->post);
 
-	}
-	close(handle);
+	ctx->events_count = ctx->events_tmp_count;
+	swap_events_tmp(ctx);
 }
 
-int tempo_fixed = 0;
 
-void add_tempo_point(uint32_t ms, uint32_t tempo)
+void out_init(sOutBuf *ob, int handle)
 {
-	tempo_ms[tempo_points] = ms;
-	tempo_value[tempo_points] = tempo;
-	if(tempo_points <= MAX_TEMPO_POINTS)
-		tempo_points++;
+	ob->handle = handle;
+	if(ob->buf == NULL) ob->buf = new char[OUT_BUF_SIZE];
+	ob->len = 0;
+	ob->failed = 0;
 }
 
-uint32_t get_tempo(uint32_t ms)
+//"-" is stdout
+int out_open(sOutBuf *ob, const char *fname)
 {
-	for(int x = tempo_points-1; x >= 0; x--)
+	if(str_eq(fname, "-"))
 	{
-		if(ms >= tempo_ms[x])
-		{
-//			if(x > 0) return tempo_value[x-1];
-			return tempo_value[x];
-		}
+		out_init(ob, 1);
+		return 1;
+	}
+	int handle = open(fname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+	if(handle < 1)
+	{
+		fprintf(stderr, "can't open/create output file %s\n", fname);
+		return 0;
 	}
-	return 500000; //MIDI default
+	out_init(ob, handle);
+	return 1;
 }
 
-double get_dt_ms(uint32_t start_ms, uint32_t ticks)
+//returns 0 if not everything was written
+int write_all(int handle, const void *data, int len)
 {
-	if(tempo_fixed) return ticks * ticks_to_ms;
-
-	double ms = start_ms;
-	for(uint32_t t = 0; t < ticks; t++)
+	const char *src = (const char*)data;
+	int pos = 0;
+	while(pos < len)
 	{
-		double cur_tempo = get_tempo(ms);
-		ticks_to_ms = (cur_tempo / 1000.0) / (double)(ticks_per_qn);
-		ms += ticks_to_ms;
+		int res = write(handle, src + pos, len - pos);
+		if(res <= 0)
+		{
+			fprintf(stderr, "write %d bytes failed\n", len - pos);
+			return 0;
+		}
+		pos += res;
 	}
-	return ms - start_ms;
+	return 1;
 }
 
-int key_map(int key)
+void out_flush(sOutBuf *ob)
 {
-	return key;
+	if(!write_all(ob->handle, ob->buf, ob->len)) ob->failed = 1;
+	ob->len = 0;
 }
-int value_map_on(int value)
+
+//large block written straight from data, after what is buffered
+void out_write_direct(sOutBuf *ob, const void *data, int len)
 {
-	return value;
-//	return TARGET_MIN + value * (TARGET_MAX-TARGET_MIN) / 127.0;
+	out_flush(ob);
+	if(!write_all(ob->handle, data, len)) ob->failed = 1;
 }
-int value_map_off(int value)
+
+//makes sure the next record fits, returns where to write it
+inline char *out_record(sOutBuf *ob)
 {
-	return 0;
+	if(ob->len + OUT_MAX_RECORD > OUT_BUF_SIZE) out_flush(ob);
+	return ob->buf + ob->len;
 }
 
-void parse_track(uint8_t *buf, int length, int out_process, int track_num)
+inline void out_commit(sOutBuf *ob, char *end)
 {
-	int pos = 0;
-	double rT = 0;
-	uint32_t T = 0;
-	int unhandled_sum = 0;
-	int out_verbose = 1;//out_process;
-	int send_out = out_process;
-	
-	int prev_msg_type = -1;
-	int prev_msg_chan = -1;
-	int prev_send = 0;
+	ob->len = end - ob->buf;
+}
+
+void out_write(sOutBuf *ob, const void *data, int len)
+{
+	const char *src = (const char*)data;
+	while(len > 0)
+	{
+		if(ob->len == OUT_BUF_SIZE) out_flush(ob);
+		int part = OUT_BUF_SIZE - ob->len;
+		if(part > len) part = len;
+		memcpy(ob->buf + ob->len, src, part);
+		ob->len += part;
+		src += part;
+		len -= part;
+	}
+}
+
+//the buffer stays for the next out_open()
+void out_close(sOutBuf *ob)
+{
+	out_flush(ob);
+	if(ob->handle > 2) close(ob->handle);
+}
+
+void out_free(sOutBuf *ob)
+{
+	delete[] ob->buf;
+	ob->buf = NULL;
+}
+
+inline char *put_str(char *p, const char *str)
+{
+	while(*str) *p++ = *str++;
+	return p;
+}
+
+inline char *put_uint(char *p, uint32_t v)
+{
+	char tmp[10];
+	int n = 0;
+	do
+	{
+		tmp[n++] = '0' + v%10;
+		v /= 10;
+	} while(v);
+	while(n) *p++ = tmp[--n];
+	return p;
+}
+
+inline char *put_int(char *p, int v)
+{
+	if(v < 0)
+	{
+		*p++ = '-';
+		return put_uint(p, -(uint32_t)v);
+	}
+	return put_uint(p, v);
+}
+
+//T,track,channel,type,key,value - same as "%d,%d,%d,%d,%d,%d"
+inline char *put_event_fields(char *p, sMIDI_event *e)
+{
+	p = put_uint(p, e->T); *p++ = ',';
+	p = put_uint(p, e->track); *p++ = ',';
+	p = put_uint(p, evt_channel(e)); *p++ = ',';
+	p = put_uint(p, evt_type(e)); *p++ = ',';
+	p = put_uint(p, evt_key(e)); *p++ = ',';
+	return put_int(p, evt_value(e));
+}
+
+//diagnostics of the parser. Per event messages are compiled out of parse_track() below log_events
+enum e_log_levels
+{
+	log_quiet = 0, //only errors
+	log_info, //per file and per track summaries
+	log_events //every system, meta and unhandled message
+};
+
+int log_level = log_events;
+sOutBuf log_out; //buffered, stdout unless -LOG=<file> is given
+
+//without a log file messages go to handle
+void log_open(const char *fname, int handle)
+{
+	if(fname == NULL || !out_open(&log_out, fname))
+		out_init(&log_out, handle);
+}
+
+void log_printf(const char *fmt, ...)
+{
+	char *p = out_record(&log_out);
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(p, OUT_MAX_RECORD, fmt, args);
+	va_end(args);
+	if(len >= OUT_MAX_RECORD) len = OUT_MAX_RECORD-1;
+	if(len > 0) log_out.len += len;
+}
+
+void log_write(const void *data, int len)
+{
+	out_write(&log_out, data, len);
+}
+
+void log_close()
+{
+	out_flush(&log_out);
+	if(log_out.handle > 2) close(log_out.handle);
+	out_free(&log_out);
+}
+
+void query_init(sEventQuery *q)
+{
+	memset(q->tracks, 0xFF, sizeof(q->tracks));
+	q->channels = 0xFFFF;
+	q->types = 0xFF;
+	q->key_min = 0;
+	q->key_max = 255;
+	q->time_min = 0;
+	q->time_max = 0xFFFFFFFF;
+}
+
+inline int query_match(const sEventQuery *q, sMIDI_event *e)
+{
+	int key = evt_key(e);
+	return ((q->tracks[e->track >> 5] >> (e->track & 31)) & 1) &&
+		((q->channels >> evt_channel(e)) & 1) &&
+		((q->types >> evt_type(e)) & 1) &&
+		key >= q->key_min && key <= q->key_max &&
+		e->T >= q->time_min && e->T <= q->time_max;
+}
+
+void snapshot_free(sQuerySnapshot *c)
+{
+	delete[] c->T;
+	delete[] c->track;
+	delete[] c->channel;
+	delete[] c->type;
+	delete[] c->key;
+	delete[] c->selection;
+	memset(c, 0, sizeof(sQuerySnapshot));
+}
+
+#ifdef __SSE2__
+//byte mask of the 16 values that are in the set given by its members
+inline __m128i set_match16(__m128i v, const uint8_t *members, int count)
+{
+	__m128i m = _mm_setzero_si128();
+	for(int x = 0; x < count; x++)
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(members[x])));
+	return m;
+}
+
+//byte mask of the 16 times within [lo, hi], compared as signed after flipping the top bit
+inline __m128i time_match16(const uint32_t *T, uint32_t lo, uint32_t hi)
+{
+	__m128i bias = _mm_set1_epi32(0x80000000);
+	__m128i vlo = _mm_set1_epi32(lo ^ 0x80000000);
+	__m128i vhi = _mm_set1_epi32(hi ^ 0x80000000);
+	__m128i m[4];
+	for(int x = 0; x < 4; x++)
+	{
+		__m128i t = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(T + x*4)), bias);
+		m[x] = _mm_andnot_si128(_mm_or_si128(_mm_cmplt_epi32(t, vlo), _mm_cmpgt_epi32(t, vhi)), _mm_set1_epi32(-1));
+	}
+	return _mm_packs_epi16(_mm_packs_epi32(m[0], m[1]), _mm_packs_epi32(m[2], m[3]));
+}
+#endif
+
+//fills snapshot.selection with a bit per selected event, returns the number of selected events.
+//Predicates that select everything are skipped, the fields of the rest are copied into the snapshot
+//columns and evaluated 16 events at a time. Has to run after the last change of events
+int query_select(sParserContext *ctx, const sEventQuery *q)
+{
+	sQuerySnapshot *c = &ctx->snapshot;
+	if(c->size < ctx->events_count)
+	{
+		snapshot_free(c);
+		c->size = ctx->events_size;
+		c->selection = new uint32_t[(c->size + 31) / 32];
+	}
+	c->count = ctx->events_count;
+	int words = (c->count + 31) / 32;
+	if(words > 0) memset(c->selection, 0, words * sizeof(uint32_t)); //no selection yet when nothing was stored
+
+	int tracks_count = 0;
+	for(int w = 0; w < 8; w++)
+		tracks_count += __builtin_popcount(q->tracks[w]);
+	int channels_count = __builtin_popcount(q->channels);
+	int types_count = __builtin_popcount(q->types);
+	int test_tracks = tracks_count < 256;
+	int test_channels = channels_count < 16;
+	int test_types = types_count < 16 && (q->types & 0xFF) != 0xFF;
+	int test_keys = q->key_min > 0 || q->key_max < 255;
+	int test_time = q->time_min > 0 || q->time_max < 0xFFFFFFFF;
+	if(!(test_tracks || test_channels || test_types || test_keys || test_time))
+	{
+		if(words > 0) memset(c->selection, 0xFF, words * sizeof(uint32_t));
+		if(c->count & 31) c->selection[words-1] = (1u << (c->count & 31)) - 1;
+		return c->count;
+	}
+
+	int n = 0;
+#ifdef __SSE2__
+	uint8_t tracks[256], channels[16], types[16];
+	for(int x = 0, t = 0; x < 256; x++)
+		if((q->tracks[x >> 5] >> (x & 31)) & 1) tracks[t++] = x;
+	for(int x = 0, ch = 0, ty = 0; x < 16; x++)
+	{
+		if((q->channels >> x) & 1) channels[ch++] = x;
+		if((q->types >> x) & 1) types[ty++] = x;
+	}
+	//columns are allocated when a query first needs them
+	if(test_time && !c->T) c->T = new uint32_t[c->size];
+	if(test_tracks && !c->track) c->track = new uint8_t[c->size];
+	if(test_channels && !c->channel) c->channel = new uint8_t[c->size];
+	if(test_types && !c->type) c->type = new uint8_t[c->size];
+	if(test_keys && !c->key) c->key = new uint8_t[c->size];
+	for(int x = 0; x < c->count; x++)
+	{
+		sMIDI_event *e = ctx->events + x;
+		if(test_time) c->T[x] = e->T;
+		if(test_tracks) c->track[x] = e->track;
+		if(test_channels) c->channel[x] = evt_channel(e);
+		if(test_types) c->type[x] = evt_type(e);
+		if(test_keys) c->key[x] = evt_key(e);
+	}
+
+	__m128i key_min = _mm_set1_epi8(q->key_min);
+	__m128i key_max = _mm_set1_epi8(q->key_max);
+	for(; n + 16 <= c->count; n += 16)
+	{
+		__m128i m = _mm_set1_epi8(-1);
+		if(test_tracks)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(c->track + n));
+			if(tracks_count <= 16)
+				m = _mm_and_si128(m, set_match16(v, tracks, tracks_count));
+			else
+			{
+				uint8_t tmp[16];
+				for(int x = 0; x < 16; x++)
+					tmp[x] = -((q->tracks[c->track[n+x] >> 5] >> (c->track[n+x] & 31)) & 1);
+				m = _mm_and_si128(m, _mm_loadu_si128((const __m128i*)tmp));
+			}
+		}
+		if(test_channels)
+			m = _mm_and_si128(m, set_match16(_mm_loadu_si128((const __m128i*)(c->channel + n)), channels, channels_count));
+		if(test_types)
+			m = _mm_and_si128(m, set_match16(_mm_loadu_si128((const __m128i*)(c->type + n)), types, types_count));
+		if(test_keys)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(c->key + n));
+			m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, key_min), v));
+			m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, key_max), v));
+		}
+		if(test_time)
+			m = _mm_and_si128(m, time_match16(c->T + n, q->time_min, q->time_max));
+		//n is a multiple of 16, so the block is the low or high half of a selection word
+		c->selection[n >> 5] |= (uint32_t)_mm_movemask_epi8(m) << (n & 16);
+	}
+#endif
+	for(; n < c->count; n++)
+		if(query_match(q, ctx->events + n))
+			c->selection[n >> 5] |= 1u << (n & 31);
+
+	int selected = 0;
+	for(int w = 0; w < words; w++)
+		selected += __builtin_popcount(c->selection[w]);
+	return selected;
+}
+
+//returns -1 if the output can't be written
+int save_python_script(sParserContext *ctx, const char *fname, const sEventQuery *q)
+{
+	sOutBuf *ob = &ctx->out;
+	if(!out_open(ob, fname)) return -1;
+
+	char *p = out_record(ob);
+	p = put_str(p, "import serial\n");
+	p = put_str(p, "import time\n");
+	p = put_str(p, "ser = serial.Serial('COM3', 115200, timeout=5)\n");
+	p = put_str(p, "time.sleep(3)\n\n");
+	p = put_str(p, "#<timestamp,track,channel,event,note,midipower>\n");
+	p = put_str(p, "ser.write('<0,0,0,8,0,0>')\n");
+	out_commit(ob, p);
+	query_select(ctx, q);
+	uint32_t *sel = ctx->snapshot.selection;
+	for(int w = 0; w < (ctx->snapshot.count + 31) / 32; w++)
+		for(uint32_t bits = sel[w]; bits; bits &= bits - 1)
+		{
+			int x = w*32 + __builtin_ctz(bits);
+			p = out_record(ob);
+			p = put_str(p, "ser.write('<");
+			p = put_event_fields(p, ctx->events + x);
+			p = put_str(p, ">')\nser.readline()\n");
+			out_commit(ob, p);
+		}
+	out_close(ob);
+	return ob->failed ? -1 : 0;
+}
+
+
+//saves write the events query_select() picks, they return -1 if the output can't be written
+int save_events(sParserContext *ctx, const char *fname, const sEventQuery *q)
+{
+	sOutBuf *ob = &ctx->out;
+	if(!out_open(ob, fname)) return -1;
+
+	query_select(ctx, q);
+	uint32_t *sel = ctx->snapshot.selection;
+	for(int w = 0; w < (ctx->snapshot.count + 31) / 32; w++)
+		for(uint32_t bits = sel[w]; bits; bits &= bits - 1)
+		{
+			char *p = out_record(ob);
+			p = put_event_fields(p, ctx->events + w*32 + __builtin_ctz(bits));
+			*p++ = '\n';
+			out_commit(ob, p);
+		}
+	out_close(ob);
+	return ob->failed ? -1 : 0;
+}
+
+//binary output: header and fixed size records, all fields little-endian, so a consumer can mmap the file
+//and use the records in place.
+//header, 16 bytes: "MEVB", u16 version, u16 record size, u32 records count, u32 flags (BIN_FLAG_)
+//record, 12 bytes: u32 T, u16 track, u8 channel<<4 | type, u8 key, i16 value, u16 reserved (0)
+#define BIN_MAGIC "MEVB"
+#define BIN_VERSION 1
+#define BIN_HEADER_SIZE 16
+#define BIN_RECORD_SIZE 12
+#define BIN_FLAG_MICROSECONDS 1 //T is in microseconds, milliseconds otherwise
+
+inline uint8_t *put_u16le(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+inline uint8_t *put_u32le(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+	return p + 4;
+}
+
+inline uint16_t get_u16le(uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+inline uint32_t get_u32le(uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int save_binary(sParserContext *ctx, const char *fname, const sEventQuery *q)
+{
+	int size = BIN_HEADER_SIZE + ctx->events_count * BIN_RECORD_SIZE;
+	if(ctx->bin_size < size)
+	{
+		delete[] ctx->bin_buf;
+		ctx->bin_size = size;
+		ctx->bin_buf = new uint8_t[ctx->bin_size];
+	}
+	uint8_t *p = ctx->bin_buf + BIN_HEADER_SIZE;
+	query_select(ctx, q);
+	uint32_t *sel = ctx->snapshot.selection;
+	for(int w = 0; w < (ctx->snapshot.count + 31) / 32; w++)
+		for(uint32_t bits = sel[w]; bits; bits &= bits - 1)
+		{
+			sMIDI_event *e = ctx->events + w*32 + __builtin_ctz(bits);
+			p = put_u32le(p, e->T);
+			p = put_u16le(p, e->track);
+			*p++ = e->chan_type;
+			*p++ = evt_key(e);
+			p = put_u16le(p, evt_value(e));
+			p = put_u16le(p, 0);
+		}
+	int len = p - ctx->bin_buf;
+	p = ctx->bin_buf;
+	memcpy(p, BIN_MAGIC, 4);
+	p = put_u16le(p + 4, BIN_VERSION);
+	p = put_u16le(p, BIN_RECORD_SIZE);
+	p = put_u32le(p, (len - BIN_HEADER_SIZE) / BIN_RECORD_SIZE);
+	put_u32le(p, ctx->time_unit == 1 ? BIN_FLAG_MICROSECONDS : 0);
+
+	sOutBuf *ob = &ctx->out;
+	if(!out_open(ob, fname)) return -1;
+	out_write_direct(ob, ctx->bin_buf, len);
+	out_close(ob);
+	return ob->failed ? -1 : 0;
+}
+
+//real-time playback on a serial device instead of the python script. Events are sent at their time minus
+//the lookahead on the monotonic clock, as the <...> records of the script or, with binary, in wire frames.
+//The device answers every record with a line or every frame with a wire answer, up to window records or
+//frames are sent before an answer is needed
+#define PLAY_LOOKAHEAD 20 //ms
+#define PLAY_WINDOW 3 //the device has a 64 byte input buffer
+#define PLAY_WAIT 3000 //ms after the port is opened, the device restarts then
+#define PLAY_ANSWER_TIMEOUT 1000 //ms
+
+typedef struct sPlayOptions
+{
+	int lookahead; //ms
+	int window; //0 - answers are not waited for
+	int wait; //ms
+	int binary; //wire frames instead of text records
+}sPlayOptions;
+
+//binary wire protocol, numbers little-endian. Frame: 0xA5 0x5A, u8 sequence number, u8 events count,
+//u16 payload length, u32 time of the first event, payload, u16 Fletcher-16 checksum of the bytes after the
+//sync bytes. Event in the payload: VLQ time after the previous event of the frame, u8 track,
+//u8 channel<<4 | type, u8 key, i16 value.
+//The device answers 0x06 <seq> for every frame it takes, in order. After a damaged frame it answers
+//0x15 <seq> with the number it expects and drops the frames after it, they are sent again from there
+#define WIRE_SYNC1 0xA5
+#define WIRE_SYNC2 0x5A
+#define WIRE_HEADER_SIZE 10
+#define WIRE_MAX_EVENTS 32
+#define WIRE_MAX_FRAME (WIRE_HEADER_SIZE + WIRE_MAX_EVENTS*10 + 2)
+#define WIRE_ACK 0x06
+#define WIRE_NAK 0x15
+#define WIRE_MAX_WINDOW 64 //a quarter of the 256 sequence numbers, far below the half where an old answer could be taken for a new one
+#define WIRE_RETRIES 5 //times the window is sent again when the device doesn't answer
+#define WIRE_NAK_RETRIES 16 //times in a row a frame can be damaged, the line is not usable then
+
+typedef struct sWireFrame
+{
+	uint8_t data[WIRE_MAX_FRAME];
+	int len;
+	int count;
+	uint8_t seq;
+	uint32_t last_T;
+}sWireFrame;
+
+uint16_t wire_checksum(const uint8_t *p, int len)
+{
+	uint32_t s1 = 0, s2 = 0;
+	for(int x = 0; x < len; x++)
+	{
+		s1 = (s1 + p[x]) % 255;
+		s2 = (s2 + s1) % 255;
+	}
+	return (s2 << 8) | s1;
+}
+
+//MIDI variable length number, parse_vbl() reads it
+inline uint8_t *put_vlq(uint8_t *p, uint32_t v)
+{
+	uint8_t groups[5];
+	int n = 0;
+	do
+	{
+		groups[n++] = v & 0x7F;
+		v >>= 7;
+	}while(v);
+	while(n > 1)
+		*p++ = groups[--n] | 0x80;
+	*p++ = groups[0];
+	return p;
+}
+
+void wire_frame_begin(sWireFrame *f, uint8_t seq, uint32_t T)
+{
+	f->seq = seq;
+	f->count = 0;
+	f->last_T = T;
+	f->data[0] = WIRE_SYNC1;
+	f->data[1] = WIRE_SYNC2;
+	f->data[2] = seq;
+	put_u32le(f->data + 6, T);
+	f->len = WIRE_HEADER_SIZE;
+}
+
+inline void wire_frame_add(sWireFrame *f, sMIDI_event *e)
+{
+	uint8_t *p = put_vlq(f->data + f->len, e->T - f->last_T);
+	*p++ = e->track;
+	*p++ = e->chan_type;
+	*p++ = evt_key(e);
+	p = put_u16le(p, evt_value(e));
+	f->last_T = e->T;
+	f->count++;
+	f->len = p - f->data;
+}
+
+void wire_frame_end(sWireFrame *f)
+{
+	f->data[3] = f->count;
+	put_u16le(f->data + 4, f->len - WIRE_HEADER_SIZE);
+	put_u16le(f->data + f->len, wire_checksum(f->data + 2, f->len - 2));
+	f->len += 2;
+}
+
+//reference decoder of the frame at the start of buf. Returns its length, 0 if it's not complete yet or -1 if
+//buf doesn't start with a valid frame. events has room for WIRE_MAX_EVENTS
+int wire_decode(uint8_t *buf, int len, uint8_t *seq, sMIDI_event *events, int *count)
+{
+	if((len >= 1 && buf[0] != WIRE_SYNC1) || (len >= 2 && buf[1] != WIRE_SYNC2)) return -1;
+	if(len < WIRE_HEADER_SIZE) return 0;
+	int payload = get_u16le(buf + 4);
+	if(buf[3] > WIRE_MAX_EVENTS || payload > WIRE_MAX_FRAME - WIRE_HEADER_SIZE - 2) return -1;
+	int frame_len = WIRE_HEADER_SIZE + payload + 2;
+	if(len < frame_len) return 0;
+	if(get_u16le(buf + frame_len - 2) != wire_checksum(buf + 2, frame_len - 4)) return -1;
+
+	uint32_t T = get_u32le(buf + 6);
+	uint8_t *p = buf + WIRE_HEADER_SIZE;
+	uint8_t *end = p + payload;
+	for(int n = 0; n < buf[3]; n++)
+	{
+		if(end - p < 6) return -1;
+		uint32_t dt;
+		p += parse_vbl_scalar(p, &dt); //parse_vbl() could read past the end of buf
+		if(end - p < 5) return -1;
+		T += dt;
+		evt_set(events + n, T, p[0], p[1] >> 4, p[1] & 0x0F, p[2], (int16_t)get_u16le(p+3));
+		p += 5;
+	}
+	if(p != end) return -1;
+	*seq = buf[2];
+	*count = buf[3];
+	return frame_len;
+}
+
+inline int64_t clock_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sleep_until_ns(int64_t t)
+{
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {} //EINTR
+}
+
+//reads the answers there are, waits up to timeout ms for the first ones. Returns the number of bytes
+int play_read(int handle, uint8_t *buf, int size, int timeout)
+{
+	struct pollfd pfd;
+	pfd.fd = handle;
+	pfd.events = POLLIN;
+	if(poll(&pfd, 1, timeout) <= 0) return 0;
+	int res = read(handle, buf, size);
+	return res > 0 ? res : 0;
+}
+
+//text records: answer lines read, waits up to timeout ms for the first one
+int play_answers(int handle, int timeout)
+{
+	int lines = 0;
+	uint8_t buf[256];
+	int res;
+	while((res = play_read(handle, buf, sizeof(buf), lines ? 0 : timeout)) > 0)
+		for(int x = 0; x < res; x++)
+			if(buf[x] == '\n') lines++;
+	return lines;
+}
+
+//next selected event from n on, -1 after the last
+inline int selection_next(const uint32_t *sel, int count, int n)
+{
+	while(n < count)
+	{
+		uint32_t bits = sel[n >> 5] >> (n & 31);
+		if(bits) return n + __builtin_ctz(bits);
+		n = (n | 31) + 1;
+	}
+	return -1;
+}
+
+inline int64_t play_send_time(sParserContext *ctx, sMIDI_event *e, int64_t lookahead)
+{
+	return ctx->play.start_ns + (int64_t)(e->T - ctx->play.first_T) * ctx->time_unit * 1000 - lookahead;
+}
+
+inline void play_jitter(sPlayStats *st, int64_t jitter, int64_t lookahead)
+{
+	st->jitter[st->events++] = jitter;
+	if(jitter > lookahead) st->late++;
+}
+
+//the python script protocol. Returns 0 or -1 if the device can't be written
+int play_records(sParserContext *ctx, int handle, const sPlayOptions *po)
+{
+	sPlayStats *st = &ctx->play;
+	sOutBuf *ob = &ctx->out;
+	out_init(ob, handle);
+	char *p = out_record(ob);
+	p = put_str(p, "<0,0,0,8,0,0>");
+	st->bytes += p - ob->buf;
+	out_commit(ob, p);
+	out_flush(ob);
+
+	int64_t lookahead = (int64_t)po->lookahead * 1000000;
+	int window = po->window;
+	int in_flight = 0;
+	uint32_t *sel = ctx->snapshot.selection;
+	for(int n = selection_next(sel, ctx->snapshot.count, 0); n >= 0; n = selection_next(sel, ctx->snapshot.count, n+1))
+	{
+		sMIDI_event *e = ctx->events + n;
+		int64_t send_at = play_send_time(ctx, e, lookahead);
+		while(window > 0 && in_flight >= window)
+		{
+			out_flush(ob);
+			int lines = play_answers(handle, PLAY_ANSWER_TIMEOUT);
+			if(lines == 0)
+			{
+				fprintf(stderr, "play: no answer from the device in %d ms, not waiting for answers anymore\n", PLAY_ANSWER_TIMEOUT);
+				window = 0;
+			}
+			in_flight -= lines;
+		}
+		if(clock_ns() < send_at)
+		{
+			out_flush(ob);
+			sleep_until_ns(send_at);
+		}
+		play_jitter(st, clock_ns() - send_at, lookahead);
+		char *rec = out_record(ob);
+		p = rec;
+		*p++ = '<';
+		p = put_event_fields(p, e);
+		*p++ = '>';
+		st->bytes += p - rec;
+		out_commit(ob, p);
+		in_flight++;
+		if(window > 0) in_flight -= play_answers(handle, 0);
+	}
+	out_flush(ob);
+	while(window > 0 && in_flight > 0)
+	{
+		int lines = play_answers(handle, PLAY_ANSWER_TIMEOUT);
+		if(lines == 0) break;
+		in_flight -= lines;
+	}
+	return ob->failed ? -1 : 0;
+}
+
+//frames sent and not answered yet, oldest first
+typedef struct sWireWindow
+{
+	int handle;
+	sWireFrame *frames;
+	int size;
+	int head;
+	int count;
+	uint8_t answer[2];
+	int answer_len;
+	int naks; //in a row for the first frame of the window
+	sPlayStats *st;
+}sWireWindow;
+
+//position of the frame with sequence number seq in the window, -1 if it's not there
+inline int wire_window_find(sWireWindow *ww, uint8_t seq)
+{
+	if(ww->count == 0) return -1;
+	int pos = (uint8_t)(seq - ww->frames[ww->head].seq);
+	return pos < ww->count ? pos : -1;
+}
+
+int wire_send(sWireWindow *ww, sWireFrame *f)
+{
+	ww->st->bytes += f->len;
+	return write_all(ww->handle, f->data, f->len);
+}
+
+//sends the frames from position pos of the window again
+int wire_resend(sWireWindow *ww, int pos)
+{
+	for(; pos < ww->count; pos++)
+	{
+		ww->st->resent++;
+		if(!wire_send(ww, ww->frames + (ww->head + pos) % ww->size)) return 0;
+	}
+	return 1;
+}
+
+//takes the device answers, waits up to timeout ms for the first ones. Returns 0 if nothing came, -1 on write errors
+int wire_answers(sWireWindow *ww, int timeout)
+{
+	uint8_t buf[256];
+	int res = play_read(ww->handle, buf, sizeof(buf), timeout);
+	int got = res;
+	while(res > 0)
+	{
+		for(int x = 0; x < res; x++)
+		{
+			if(ww->answer_len == 0 && buf[x] != WIRE_ACK && buf[x] != WIRE_NAK) continue; //noise
+			ww->answer[ww->answer_len++] = buf[x];
+			if(ww->answer_len < 2) continue;
+			ww->answer_len = 0;
+			int pos = wire_window_find(ww, ww->answer[1]);
+			if(pos < 0) continue; //answer to a frame that was sent again
+			if(ww->answer[0] == WIRE_ACK) pos++;
+			ww->head = (ww->head + pos) % ww->size; //the device has the frames before pos
+			ww->count -= pos;
+			ww->naks = (pos == 0) ? ww->naks + 1 : 0;
+			if(ww->answer[0] != WIRE_NAK) continue;
+			if(ww->naks > WIRE_NAK_RETRIES)
+			{
+				fprintf(stderr, "play: frame %d damaged %d times\n", ww->answer[1], ww->naks);
+				return -1;
+			}
+			if(!wire_resend(ww, 0)) return -1;
+		}
+		res = play_read(ww->handle, buf, sizeof(buf), 0);
+		got += res;
+	}
+	return got > 0;
+}
+
+//waits until the window has fewer than max frames, sends them again when the device doesn't answer.
+//Returns 0 if it doesn't answer at all
+int wire_wait(sWireWindow *ww, int max)
+{
+	int retries = 0;
+	while(ww->count >= max && ww->count > 0)
+	{
+		int res = wire_answers(ww, PLAY_ANSWER_TIMEOUT);
+		if(res < 0) return 0;
+		if(res > 0)
+		{
+			retries = 0;
+			continue;
+		}
+		if(++retries > WIRE_RETRIES)
+		{
+			fprintf(stderr, "play: no answer from the device after %d tries\n", WIRE_RETRIES);
+			return 0;
+		}
+		if(!wire_resend(ww, 0)) return 0;
+	}
+	return 1;
+}
+
+//binary protocol: events due together go in one frame. Returns 0 or -1 if the device fails
+int play_frames(sParserContext *ctx, int handle, const sPlayOptions *po)
+{
+	sPlayStats *st = &ctx->play;
+	sWireWindow ww;
+	memset(&ww, 0, sizeof(ww));
+	ww.handle = handle;
+	ww.st = st;
+	int window = po->window > WIRE_MAX_WINDOW ? WIRE_MAX_WINDOW : po->window;
+	ww.size = window > 0 ? window : 1;
+	ww.frames = new sWireFrame[ww.size];
+	int failed = 0;
+	uint8_t seq = 0;
+
+	sWireFrame *f = ww.frames;
+	sMIDI_event reset;
+	evt_set(&reset, 0, 0, 0, 8, 0, 0);
+	wire_frame_begin(f, seq++, 0);
+	wire_frame_add(f, &reset);
+	wire_frame_end(f);
+	if(!wire_send(&ww, f)) failed = 1;
+	st->frames++;
+	if(window > 0) ww.count = 1;
+
+	int64_t lookahead = (int64_t)po->lookahead * 1000000;
+	uint32_t *sel = ctx->snapshot.selection;
+	int n = selection_next(sel, ctx->snapshot.count, 0);
+	while(n >= 0 && !failed)
+	{
+		if(window > 0 && !wire_wait(&ww, window))
+		{
+			failed = 1;
+			break;
+		}
+		int64_t send_at = play_send_time(ctx, ctx->events + n, lookahead);
+		if(clock_ns() < send_at) sleep_until_ns(send_at);
+		int64_t now = clock_ns();
+		f = ww.frames + (ww.head + ww.count) % ww.size;
+		wire_frame_begin(f, seq++, ctx->events[n].T);
+		while(n >= 0 && f->count < WIRE_MAX_EVENTS)
+		{
+			send_at = play_send_time(ctx, ctx->events + n, lookahead);
+			if(send_at > now) break;
+			play_jitter(st, now - send_at, lookahead);
+			wire_frame_add(f, ctx->events + n);
+			n = selection_next(sel, ctx->snapshot.count, n+1);
+		}
+		wire_frame_end(f);
+		if(!wire_send(&ww, f)) failed = 1;
+		st->frames++;
+		if(window > 0)
+		{
+			ww.count++;
+			if(wire_answers(&ww, 0) < 0) failed = 1;
+		}
+	}
+	if(!failed && window > 0 && !wire_wait(&ww, 1)) failed = 1;
+	delete[] ww.frames;
+	return failed ? -1 : 0;
+}
+
+int jitter_cmp(const void *a, const void *b)
+{
+	int64_t j1 = *(const int64_t*)a;
+	int64_t j2 = *(const int64_t*)b;
+	return (j1 < j2) ? -1 : (j1 > j2);
+}
+
+//plays the selected events on the tty, statistics go to ctx->play. Returns number of events or -1
+int play_events(sParserContext *ctx, const char *tty, const sEventQuery *q, const sPlayOptions *po)
+{
+	sPlayStats *st = &ctx->play;
+	int handle = open(tty, O_RDWR | O_NOCTTY);
+	if(handle < 0)
+	{
+		fprintf(stderr, "can't open serial device %s\n", tty);
+		return -1;
+	}
+	struct termios tio;
+	if(tcgetattr(handle, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		cfsetispeed(&tio, B115200);
+		cfsetospeed(&tio, B115200);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(handle, TCSANOW, &tio);
+	}
+	prctl(PR_SET_TIMERSLACK, 1000); //wakeups within 1 us, the default lets them come 50 us late
+	if(po->wait > 0) sleep_until_ns(clock_ns() + (int64_t)po->wait * 1000000);
+
+	query_select(ctx, q);
+	uint32_t *sel = ctx->snapshot.selection;
+	int count = 0;
+	for(int w = 0; w < (ctx->snapshot.count + 31) / 32; w++)
+		count += __builtin_popcount(sel[w]);
+	if(st->jitter_size < count)
+	{
+		delete[] st->jitter;
+		st->jitter_size = count;
+		st->jitter = new int64_t[st->jitter_size];
+	}
+	st->events = st->late = 0;
+	st->frames = st->resent = 0;
+	st->bytes = 0;
+	st->start_ns = clock_ns() + (int64_t)po->lookahead * 1000000; //the first event is not late already
+	int first = selection_next(sel, ctx->snapshot.count, 0);
+	st->first_T = first >= 0 ? ctx->events[first].T : 0;
+
+	int res = po->binary ? play_frames(ctx, handle, po) : play_records(ctx, handle, po);
+	close(handle);
+	if(res < 0) return -1;
+
+	double dt = (clock_ns() - st->start_ns) * 1e-9;
+	if(st->events > 0)
+	{
+		int64_t sum = 0;
+		for(int n = 0; n < st->events; n++)
+			sum += st->jitter[n];
+		qsort(st->jitter, st->events, sizeof(int64_t), jitter_cmp);
+		fprintf(stderr, "play: %d events in %.3f s, %d late, %lld bytes\n", st->events, dt, st->late, (long long)st->bytes);
+		fprintf(stderr, "play: send jitter mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n", sum * 1e-3 / st->events,
+			st->jitter[st->events / 2] * 1e-3, st->jitter[(int64_t)st->events * 99 / 100] * 1e-3, st->jitter[st->events - 1] * 1e-3);
+		if(po->binary)
+			fprintf(stderr, "play: %d frames, %.1f events per frame, %d sent again\n", st->frames, (double)st->events / st->frames, st->resent);
+	}
+	return st->events;
+}
+
+void tempo_map_add(sTempoMap *map, uint32_t tick, uint32_t tempo)
+{
+	if(map->count >= map->size)
+	{
+		map->size = map->size ? map->size*2 : 64;
+		sTempoPoint *pp = new sTempoPoint[map->size];
+		for(int x = 0; x < map->count; x++)
+			pp[x] = map->points[x];
+		delete[] map->points;
+		map->points = pp;
+	}
+	sTempoPoint *tp = map->points + map->count;
+	tp->tick = tick;
+	tp->tempo = tempo;
+	tp->acc = 0;
+	tp->order = map->count;
+	map->count++;
+}
+
+int tempo_point_cmp(const void *a, const void *b)
+{
+	const sTempoPoint *p1 = (const sTempoPoint*)a;
+	const sTempoPoint *p2 = (const sTempoPoint*)b;
+	if(p1->tick != p2->tick) return (p1->tick < p2->tick) ? -1 : 1;
+	return p1->order - p2->order;
+}
+
+//sorts collected points, drops overridden ones and fills prefix sums, has to be called before any tick conversion
+void tempo_map_build(sTempoMap *map)
+{
+	int sorted = 1;
+	for(int x = 1; x < map->count; x++)
+		if(tempo_point_cmp(map->points+x-1, map->points+x) > 0) sorted = 0;
+	if(!sorted)
+		qsort(map->points, map->count, sizeof(sTempoPoint), tempo_point_cmp);
+
+	if(map->count == 0 || map->points[0].tick > 0)
+	{
+		tempo_map_add(map, 0, 500000); //MIDI default until the first tempo event
+		sTempoPoint def = map->points[map->count-1];
+		for(int x = map->count-1; x > 0; x--)
+			map->points[x] = map->points[x-1];
+		map->points[0] = def;
+	}
+
+	int n = 0;
+	for(int x = 0; x < map->count; x++)
+	{
+		if(n > 0 && map->points[n-1].tick == map->points[x].tick)
+			n--; //several tempo events at the same tick - the last one wins
+		map->points[n] = map->points[x];
+		n++;
+	}
+	map->count = n;
+
+	map->points[0].acc = 0;
+	for(int x = 1; x < map->count; x++)
+	{
+		sTempoPoint *prev = map->points + x - 1;
+		map->points[x].acc = prev->acc + (uint64_t)(map->points[x].tick - prev->tick) * prev->tempo;
+	}
+}
+
+//binary search for the last tempo point at or before tick
+int tempo_segment(sTempoMap *map, uint32_t tick)
+{
+	int lo = 0, hi = map->count - 1;
+	while(lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if(map->points[mid].tick <= tick) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+//time of tick in output units, *seg is the tempo segment to start the search from and is moved to the one of tick.
+//A negative *seg is found by binary search, then ticks that don't go back only walk forward from it.
+//Integer only and truncated once, so the result is exact and the same on every machine
+inline uint32_t tick_to_time(sParserContext *ctx, uint32_t tick, int *seg)
+{
+	uint64_t us;
+	if(ctx->tempo_fixed)
+		us = (uint64_t)tick * ctx->smpte_num / ctx->smpte_den;
+	else
+	{
+		if(*seg < 0) *seg = tempo_segment(&ctx->tempo_map, tick);
+		while(*seg+1 < ctx->tempo_map.count && ctx->tempo_map.points[*seg+1].tick <= tick) (*seg)++;
+		sTempoPoint *tp = ctx->tempo_map.points + *seg;
+		us = (tp->acc + (uint64_t)(tick - tp->tick) * tp->tempo) / ctx->ticks_per_qn;
+	}
+	us /= ctx->time_unit;
+	if(us > 0xFFFFFFFF) //about 71 minutes in microseconds, clamped so the order is kept
+	{
+		ctx->time_overflow = 1;
+		return 0xFFFFFFFF;
+	}
+	return us;
+}
+
+//second pass: events[first..events_count) hold absolute ticks after parsing, turns them into output time units
+void convert_event_times(sParserContext *ctx, int first)
+{
+	//events of one track are monotonic in ticks, so the segment is searched once per track and then only moves forward
+	int seg = -1;
+	uint32_t prev_tick = 0;
+	for(int n = first; n < ctx->events_count; n++)
+	{
+		uint32_t tick = ctx->events[n].T;
+		if(tick < prev_tick) seg = -1;
+		prev_tick = tick;
+		ctx->events[n].T = tick_to_time(ctx, tick, &seg);
+	}
+}
+
+int key_map(int key)
+{
+	return key;
+}
+int value_map_on(int value)
+{
+	return value;
+//	return TARGET_MIN + value * (TARGET_MAX-TARGET_MIN) / 127.0;
+}
+int value_map_off(int value)
+{
+	return 0;
+}
+
+//dispatch tables of parse_track(): everything about a message is found by its status byte
+enum e_msg_kinds
+{
+	msg_invalid = 0, //data byte without running status, undefined system messages
+	msg_channel,
+	msg_system, //system common and real time, fixed length
+	msg_sysex, //F0 and F7, variable length
+	msg_meta //FF in a file
+};
+
+enum e_data_layouts
+{
+	data_key_value = 0, //key, value
+	data_value, //single data byte, key is set to 255
+	data_value14 //pitch bend, key is set to 255
+};
+
+typedef struct sStatusInfo
+{
+	uint8_t kind;
+	uint8_t length; //data bytes after the status byte for fixed length messages
+	uint8_t evt_type; //for channel messages
+	uint8_t layout;
+	const char *name;
+}sStatusInfo;
+
+enum e_meta_kinds
+{
+	meta_unknown = 0,
+	meta_other, //only reported
+	meta_text,
+	meta_tempo,
+	meta_end
+};
+
+typedef struct sMetaInfo
+{
+	uint8_t kind;
+	const char *name;
+}sMetaInfo;
+
+sStatusInfo status_table[256];
+sMetaInfo meta_table[256];
+
+void set_status(int status, uint8_t kind, uint8_t length, uint8_t evt_type, uint8_t layout, const char *name)
+{
+	sStatusInfo *si = status_table + status;
+	si->kind = kind;
+	si->length = length;
+	si->evt_type = evt_type;
+	si->layout = layout;
+	si->name = name;
+}
+
+void set_meta(int type, uint8_t kind, const char *name)
+{
+	meta_table[type].kind = kind;
+	meta_table[type].name = name;
+}
+
+int init_dispatch_tables()
+{
+	for(int ch = 0; ch < 16; ch++)
+	{
+		set_status(0x80|ch, msg_channel, 2, evt_note_off, data_key_value, "note off");
+		set_status(0x90|ch, msg_channel, 2, evt_note_on, data_key_value, "note on");
+		set_status(0xA0|ch, msg_channel, 2, evt_aftertouch, data_key_value, "aftertouch");
+		set_status(0xB0|ch, msg_channel, 2, evt_ctrl_change, data_key_value, "controller");
+		set_status(0xC0|ch, msg_channel, 1, evt_prog_change, data_value, "program");
+		set_status(0xD0|ch, msg_channel, 1, evt_chan_keypress, data_value, "channel pressure");
+		set_status(0xE0|ch, msg_channel, 2, evt_pitch_bend, data_value14, "pitch bend");
+	}
+	set_status(0xF0, msg_sysex, 0, 0, 0, "sysex F0");
+	set_status(0xF1, msg_system, 1, 0, 0, "MIDI Time Code Qtr. Frame");
+	set_status(0xF2, msg_system, 2, 0, 0, "Song Position Pointer");
+	set_status(0xF3, msg_system, 1, 0, 0, "Song Select");
+	set_status(0xF6, msg_system, 0, 0, 0, "Tune Request");
+	set_status(0xF7, msg_sysex, 0, 0, 0, "sysex F7");
+	set_status(0xF8, msg_system, 0, 0, 0, "Timing clock");
+	set_status(0xFA, msg_system, 0, 0, 0, "Start");
+	set_status(0xFB, msg_system, 0, 0, 0, "Continue");
+	set_status(0xFC, msg_system, 0, 0, 0, "Stop");
+	set_status(0xFE, msg_system, 0, 0, 0, "Active Sensing");
+	set_status(0xFF, msg_meta, 0, 0, 0, "meta");
+
+	set_meta(0x00, meta_other, "Sequence Number");
+	set_meta(0x01, meta_text, "text");
+	set_meta(0x02, meta_text, "copyright");
+	set_meta(0x03, meta_text, "Track Name");
+	set_meta(0x04, meta_text, "Instrument Name");
+	set_meta(0x05, meta_text, "Lyrics");
+	set_meta(0x06, meta_text, "Marker");
+	set_meta(0x07, meta_text, "Cue Point");
+	set_meta(0x08, meta_text, "Program Name");
+	set_meta(0x09, meta_text, "Device Name");
+	set_meta(0x20, meta_other, "channel prefix");
+	set_meta(0x21, meta_other, "port prefix");
+	set_meta(0x2F, meta_end, "track end");
+	set_meta(0x51, meta_tempo, "tempo");
+	set_meta(0x54, meta_other, "SMTPE offset");
+	set_meta(0x58, meta_other, "Time Signature");
+	set_meta(0x59, meta_other, "Key Signature");
+	set_meta(0x60, meta_other, "XMF");
+	set_meta(0x7F, meta_other, "Sequencer-Specific");
+	return 1;
+}
+
+int dispatch_tables_ready = init_dispatch_tables();
+
+//parse_track() is instantiated for fixed event masks and zero_to_off, so tests for types that can't be
+//stored and for the option are resolved at compile time. SEND_ANY and -1 take them from send_out and ctx
+#define SEND_ANY -1
+#define SEND_NOTES (SEND_NOTE_ON | SEND_NOTE_OFF | SEND_TRACK_END)
+#define SEND_NOTES_CC_PB (SEND_NOTES | SEND_CTRL_CHANGE | SEND_PITCH_BEND)
+#define SEND_KEYLESS (SEND_PROG_CHANGE | SEND_CHAN_KEYPRES | SEND_PITCH_BEND)
+
+//appends an event, parse_track() has already applied zero_to_off
+inline void push_event(sParserContext *ctx, sMIDI_event *evt)
+{
+	if(ctx->events_count >= ctx->events_size)
+		reserve_events(ctx, ctx->events_size < EVENTS_MIN_ALLOC ? EVENTS_MIN_ALLOC : ctx->events_size*2);
+	int n = ctx->events_count++;
+	ctx->events[n] = *evt;
+}
+
+template<int LOG_LEVEL, int MASK, int ZERO_TO_OFF> void parse_track(sParserContext *ctx, uint8_t *buf, int length, int send_out, int track_num)
+{
+	const int send = (MASK == SEND_ANY) ? send_out : MASK;
+	const int zero_to_off = (ZERO_TO_OFF < 0) ? ctx->zero_to_off : ZERO_TO_OFF;
+	int pos = 0;
+	uint32_t T = 0; //absolute time in ticks, converted by convert_event_times() when all tracks are read
+	int unhandled_sum = 0;
+	uint8_t running_status = 0; //status of the last channel message, 0 if system or meta message cancelled it
+
+	while(pos < length)
+	{
+		uint32_t dt;
+		pos += parse_vbl(buf+pos, &dt);
+		T += dt;
+		uint8_t status = buf[pos];
+		uint8_t *data = buf + pos + 1;
+		if(status < 0x80) //data bytes of a message with the previous status
+		{
+			status = running_status;
+			data = buf + pos;
+		}
+		const sStatusInfo *si = status_table + status;
+
+		if(si->kind == msg_channel)
+		{
+			running_status = status;
+			if(send & (1<<si->evt_type))
+			{
+				sMIDI_event evt;
+				if(!(send & SEND_KEYLESS) || si->layout == data_key_value)
+				{
+					int type = si->evt_type;
+					int value = data[1];
+					if(zero_to_off && type == evt_note_on && value == 0)
+					{
+						type = evt_note_off;
+						value = 64;
+					}
+					evt.T = T;
+					evt.track = track_num;
+					evt.chan_type = ((status & 0x0F) << 4) | type;
+					evt.data = ((data[0] & 0x7F) << 9) | value;
+				}
+				else
+					evt_set(&evt, T, track_num, status & 0x0F, si->evt_type, 255, (si->layout == data_value14) ? (data[1]<<8) + data[0] : data[0]);
+				push_event(ctx, &evt);
+			}
+			pos = (data - buf) + si->length;
+			continue;
+		}
+		if(si->kind == msg_system)
+		{
+			running_status = 0;
+			if(LOG_LEVEL >= log_events) log_printf("(%d) %s\n", T, si->name);
+			pos += 1 + si->length;
+			continue;
+		}
+		if(si->kind == msg_sysex)
+		{
+			running_status = 0;
+			if(LOG_LEVEL >= log_events) log_printf("(%d) %s\n", T, si->name);
+			uint32_t len = 0;
+			pos += 1 + parse_vbl(buf+pos+1, &len);
+			pos += len;
+			continue;
+		}
+		if(si->kind == msg_meta)
+		{
+			running_status = 0;
+			uint8_t mtype = buf[pos+1];
+			uint32_t len = 0;
+			pos += 2 + parse_vbl(buf+pos+2, &len);
+			uint8_t *mdata = buf + pos;
+			const sMetaInfo *mi = meta_table + mtype;
+			if(mi->kind == meta_text)
+			{
+				if(LOG_LEVEL >= log_events)
+				{
+					log_printf("(%d) meta %s: ", T, mi->name);
+					log_write(mdata, len);
+					log_write("\n", 1);
+				}
+			}
+			else if(mi->kind == meta_tempo)
+			{
+				uint32_t mpqn = (mdata[0]<<16)|(mdata[1]<<8)|mdata[2];
+				if(LOG_LEVEL >= log_events) log_printf("(%d) meta tempo %d\n", T, mpqn);
+				tempo_map_add(&ctx->tempo_map, T, mpqn);
+			}
+			else if(mi->kind == meta_end)
+			{
+				if(LOG_LEVEL >= log_events) log_printf("(%d) meta track end\n", T);
+				if(send & SEND_TRACK_END)
+				{
+					sMIDI_event evt;
+					evt_set(&evt, T, track_num, 0x0F, evt_track_end, 255, 255);
+					push_event(ctx, &evt);
+				}
+			}
+			else if(LOG_LEVEL >= log_events)
+			{
+				if(mi->kind == meta_other) log_printf("(%d) meta %s\n", T, mi->name);
+				else log_printf("unhandled meta: %02X, length %d\n", mtype, len);
+			}
+			pos += len;
+			continue;
+		}
+
+		if(LOG_LEVEL >= log_events)
+		{
+			log_printf("(%d, %d) unhandled ", T, pos);
+			for(int nn = 0; nn < 16; nn++)
+				log_printf("%02X ", buf[pos-3+nn]);
+			log_printf("\n");
+		}
+		unhandled_sum++;
+		T -= dt; //the byte is read as the next delta time
+	}
+	if(LOG_LEVEL >= log_info) fprintf(stderr, "unhandled messages: %d\n", unhandled_sum);
+}
+
+uint32_t chunk_length(uint8_t *buf)
+{
+	uint32_t len;
+	len = buf[4]; len <<= 8;
+	len += buf[5]; len <<= 8;
+	len += buf[6]; len <<= 8;
+	len += buf[7];
+	return len;
+}
+
+#define MAX_TRACKS 256 //events keep 8 bits of the track number
+
+//tracks past MAX_TRACKS are read for tempo events only
+inline int track_enabled(sParserContext *ctx, int track)
+{
+	if(track >= MAX_TRACKS) return 0;
+	return (ctx->track_set[track >> 5] >> (track & 31)) & 1;
+}
+
+//number of events parse_track() will store from the track, walks the messages without decoding them.
+//VLQ is the number decoder, so -BENCHVLQ can run it with both
+template<int (*VLQ)(uint8_t *buf, uint32_t *res)> int prescan_track(uint8_t *buf, int length, int send_out)
+{
+	int pos = 0;
+	int count = 0;
+	uint8_t running_status = 0;
+	while(pos < length)
+	{
+		uint32_t dt;
+		pos += VLQ(buf+pos, &dt);
+		uint8_t status = buf[pos];
+		int data = pos + 1;
+		if(status < 0x80)
+		{
+			status = running_status;
+			data = pos;
+		}
+		const sStatusInfo *si = status_table + status;
+		if(si->kind == msg_channel)
+		{
+			running_status = status;
+			count += (send_out >> si->evt_type) & 1;
+			pos = data + si->length;
+		}
+		else if(si->kind == msg_system)
+		{
+			running_status = 0;
+			pos += 1 + si->length;
+		}
+		else if(si->kind == msg_sysex || si->kind == msg_meta)
+		{
+			running_status = 0;
+			int skip = (si->kind == msg_meta) ? 2 : 1;
+			if(si->kind == msg_meta && meta_table[buf[pos+1]].kind == meta_end && (send_out & SEND_TRACK_END)) count++;
+			uint32_t len = 0;
+			pos += skip + VLQ(buf+pos+skip, &len);
+			pos += len;
+		}
+		//unhandled byte is read as the next delta time
+	}
+	return count;
+}
+
+typedef void (*tParseTrack)(sParserContext *ctx, uint8_t *buf, int length, int send_out, int track_num);
+
+template<int LOG_LEVEL> tParseTrack select_parse_track(int send_out, int zero_to_off)
+{
+	if(send_out == 0) //tempo scan of a disabled track
+		return parse_track<LOG_LEVEL, 0, 0>;
+	if(send_out == SEND_NOTES)
+		return zero_to_off ? parse_track<LOG_LEVEL, SEND_NOTES, 1> : parse_track<LOG_LEVEL, SEND_NOTES, 0>;
+	if(send_out == SEND_NOTES_CC_PB)
+		return zero_to_off ? parse_track<LOG_LEVEL, SEND_NOTES_CC_PB, 1> : parse_track<LOG_LEVEL, SEND_NOTES_CC_PB, 0>;
+	return parse_track<LOG_LEVEL, SEND_ANY, -1>;
+}
+
+void parse_chunk_track(sParserContext *ctx, sTrackChunk *tc, int send_out, int level)
+{
+	if(!track_enabled(ctx, tc->track)) send_out = 0; //only tempo events are taken from it
+	tParseTrack parse;
+	if(level >= log_events)
+		parse = select_parse_track<log_events>(send_out, ctx->zero_to_off);
+	else if(level == log_info)
+		parse = select_parse_track<log_info>(send_out, ctx->zero_to_off);
+	else
+		parse = select_parse_track<log_quiet>(send_out, ctx->zero_to_off);
+	if(send_out && tc->expected < 0)
+	{
+		int need = ctx->events_count + prescan_track<parse_vbl>(tc->data, tc->length, send_out);
+		if(need > ctx->events_size) reserve_events(ctx, need > ctx->events_size*2 ? need : ctx->events_size*2);
+	}
+	tc->first_event = ctx->events_count;
+	tc->first_tempo = ctx->tempo_map.count;
+	parse(ctx, tc->data, tc->length, send_out, tc->track);
+	tc->end_event = ctx->events_count;
+	tc->end_tempo = ctx->tempo_map.count;
+}
+
+typedef struct sTrackWorker
+{
+	pthread_t thread;
+	int id;
+	sParserContext *ctx; //own events and tempo points of the worker
+	sTrackChunk *chunks;
+	int chunks_count;
+	int *next_chunk; //shared by all workers
+	int send_out;
+}sTrackWorker;
+
+void track_workers_free(sTrackWorker *tw)
+{
+	delete[] tw;
+}
+
+void *track_worker_run(void *arg)
+{
+	sTrackWorker *w = (sTrackWorker*)arg;
+	//per event diagnostics of several threads would be interleaved, so workers log per track at most
+	int level = (log_level > log_info) ? log_info : log_level;
+	while(1)
+	{
+		int n = __sync_fetch_and_add(w->next_chunk, 1);
+		if(n >= w->chunks_count) break;
+		w->chunks[n].worker = w->id;
+		parse_chunk_track(w->ctx, w->chunks + n, w->send_out, level);
+	}
+	return NULL;
+}
+
+//parses tracks on a pool of threads into the workers' own contexts, then collects
+//events and tempo points of every track into ctx in track order
+void parse_tracks_parallel(sParserContext *ctx, int chunks_count, int send_out)
+{
+	int workers_count = ctx->threads;
+	if(workers_count > chunks_count) workers_count = chunks_count;
+	if(ctx->workers_size < workers_count)
+	{
+		sParserContext *ww = new sParserContext[workers_count];
+		for(int w = 0; w < workers_count; w++)
+			if(w < ctx->workers_size)
+				ww[w] = ctx->workers[w];
+			else
+				parser_init(ww + w);
+		delete[] ctx->workers;
+		ctx->workers = ww;
+		delete[] ctx->track_workers;
+		ctx->track_workers = new sTrackWorker[workers_count];
+		ctx->workers_size = workers_count;
+	}
+	//the threads are started for every file, their contexts and state are kept in ctx
+	sTrackWorker *workers = ctx->track_workers;
+	int next_chunk = 0;
+	for(int w = 0; w < workers_count; w++)
+	{
+		workers[w].id = w;
+		workers[w].ctx = ctx->workers + w;
+		parser_reset(workers[w].ctx);
+		workers[w].ctx->zero_to_off = ctx->zero_to_off;
+		memcpy(workers[w].ctx->track_set, ctx->track_set, sizeof(ctx->track_set));
+		workers[w].chunks = ctx->chunks;
+		workers[w].chunks_count = chunks_count;
+		workers[w].next_chunk = &next_chunk;
+		workers[w].send_out = send_out;
+	}
+	for(int w = 1; w < workers_count; w++)
+		if(pthread_create(&workers[w].thread, NULL, track_worker_run, workers + w) != 0)
+			workers[w].thread = 0;
+	track_worker_run(workers); //calling thread is the first worker
+	for(int w = 1; w < workers_count; w++)
+		if(workers[w].thread)
+			pthread_join(workers[w].thread, NULL);
+		else
+			track_worker_run(workers + w); //thread wasn't created, the work is done here
+
+	int total = ctx->events_count;
+	for(int n = 0; n < chunks_count; n++)
+		total += ctx->chunks[n].end_event - ctx->chunks[n].first_event;
+	reserve_events(ctx, total);
+	for(int n = 0; n < chunks_count; n++)
+	{
+		sTrackChunk *tc = ctx->chunks + n;
+		sParserContext *wctx = workers[tc->worker].ctx;
+		int cnt = tc->end_event - tc->first_event;
+		if(cnt > 0) memcpy(ctx->events + ctx->events_count, wctx->events + tc->first_event, cnt * sizeof(sMIDI_event));
+		ctx->events_count += cnt;
+		for(int t = tc->first_tempo; t < tc->end_tempo; t++)
+			tempo_map_add(&ctx->tempo_map, wctx->tempo_map.points[t].tick, wctx->tempo_map.points[t].tempo);
+	}
+}
+
+//MThd chunk data
+void parse_header(sParserContext *ctx, uint8_t *data)
+{
+	int format = (data[0]<<8) | data[1];
+	int tracks = (data[2]<<8) | data[3];
+	int tpqn_type = !(data[4] > 0x7F);
+	int tpqn = (data[4]<<8) | data[5];
+	int fps = -(int8_t)data[4]; //negative SMPTE format: -24, -25, -29 (30 drop frame) or -30
+	int tpf = data[5];
+
+	if(tpqn_type)
+	{
+		if(log_level >= log_info) fprintf(stderr, "MIDI format %d, tracks %d, tpqn %d\n", format, tracks, tpqn);
+		ctx->ticks_per_qn = tpqn;
+		ctx->tempo_fixed = 0;
+	}
+	else
+	{
+		if(log_level >= log_info) fprintf(stderr, "MIDI format %d, tracks %d, fps %d, tpf %d\n", format, tracks, fps, tpf);
+		//tick is 1/(fps*tpf) s, drop frame runs at 30000/1001 frames per second
+		ctx->smpte_num = (fps == 29) ? 1001000 : 1000000;
+		ctx->smpte_den = ((fps == 29) ? 30 : fps) * tpf;
+		if(ctx->smpte_den == 0)
+		{
+			fprintf(stderr, "bad SMPTE division: fps %d, tpf %d\n", fps, tpf);
+			ctx->smpte_den = 1;
+		}
+		ctx->tempo_fixed = 1;
+	}
+}
+
+void track_limit_warn()
+{
+	fprintf(stderr, "more than %d tracks, events of the others are dropped, their tempo events are kept\n", MAX_TRACKS);
+}
+
+//reads the header and finds the track chunks, tracks are independent byte ranges. Returns the number of tracks
+int index_chunks(sParserContext *ctx, uint8_t *buf, int length)
+{
+	int pos = 0;
+	uint8_t type[5];
+	type[4] = 0;
+	int chunks_count = 0;
+	while(pos + 8 <= length)
+	{
+		uint32_t len = chunk_length(buf + pos);
+		for(int x = 0; x < 4; x++)
+			type[x] = buf[pos + x];
+		if(log_level >= log_info) fprintf(stderr, "%s: %d\n", type, len);
+		if(str_eq((char*)type, "MThd"))
+			parse_header(ctx, buf + pos + 8);
+		if(str_eq((char*)type, "MTrk"))
+		{
+			if(chunks_count >= ctx->chunks_size)
+			{
+				ctx->chunks_size = ctx->chunks_size ? ctx->chunks_size*2 : 64;
+				sTrackChunk *cc = new sTrackChunk[ctx->chunks_size];
+				if(chunks_count > 0) memcpy(cc, ctx->chunks, chunks_count * sizeof(sTrackChunk));
+				delete[] ctx->chunks;
+				ctx->chunks = cc;
+			}
+			if(chunks_count == MAX_TRACKS) track_limit_warn();
+			sTrackChunk *tc = ctx->chunks + chunks_count;
+			tc->data = buf + pos + 8;
+			tc->length = (pos + 8 + len <= (uint32_t)length) ? len : length - pos - 8;
+			tc->track = chunks_count;
+			tc->worker = 0;
+			tc->expected = -1;
+			chunks_count++;
+		}
+		pos += 8 + len;
+	}
+	return chunks_count;
+}
+
+void parse_midi(sParserContext *ctx, uint8_t *buf, int length, int send_out)
+{
+	int first_event = ctx->events_count;
+	ctx->tempo_map.count = 0;
+	int chunks_count = index_chunks(ctx, buf, length);
+
+	if(ctx->threads > 1 && chunks_count > 1)
+		parse_tracks_parallel(ctx, chunks_count, send_out);
+	else
+	{
+		//events of all tracks are counted first, so the array is allocated once with the exact size
+		int total = ctx->events_count;
+		for(int n = 0; n < chunks_count; n++)
+		{
+			sTrackChunk *tc = ctx->chunks + n;
+			tc->expected = track_enabled(ctx, tc->track) ? prescan_track<parse_vbl>(tc->data, tc->length, send_out) : 0;
+			total += tc->expected;
+		}
+		reserve_events(ctx, total);
+		for(int n = 0; n < chunks_count; n++)
+			parse_chunk_track(ctx, ctx->chunks + n, send_out, log_level);
+	}
+
+	//tempo events from all tracks are known now, so timing doesn't depend on tracks order
+	tempo_map_build(&ctx->tempo_map);
+	convert_event_times(ctx, first_event);
+}
+
+//decodes up to the next event of the cursor that send_out selects. Returns 0 at the end of the track
+int track_cursor_next(sParserContext *ctx, sTrackCursor *cur, int send_out)
+{
+	uint8_t *buf = cur->data;
+	while(cur->pos < cur->length)
+	{
+		uint32_t dt;
+		cur->pos += parse_vbl(buf+cur->pos, &dt);
+		cur->tick += dt;
+		uint8_t status = buf[cur->pos];
+		uint8_t *data = buf + cur->pos + 1;
+		if(status < 0x80)
+		{
+			status = cur->running_status;
+			data = buf + cur->pos;
+		}
+		const sStatusInfo *si = status_table + status;
+		sMIDI_event *evt = &cur->evt;
+
+		if(si->kind == msg_channel)
+		{
+			cur->running_status = status;
+			cur->pos = (data - buf) + si->length;
+			if(!(send_out & (1<<si->evt_type))) continue;
+			if(si->layout == data_key_value)
+				evt_set(evt, 0, cur->track, status & 0x0F, si->evt_type, data[0], data[1]);
+			else
+				evt_set(evt, 0, cur->track, status & 0x0F, si->evt_type, 255, (si->layout == data_value14) ? (data[1]<<8) + data[0] : data[0]);
+			if(ctx->zero_to_off && evt_type(evt) == evt_note_on && evt_value(evt) == 0)
+			{
+				evt_set_type(evt, evt_note_off);
+				evt_set_value(evt, 64);
+			}
+		}
+		else if(si->kind == msg_system)
+		{
+			cur->running_status = 0;
+			cur->pos += 1 + si->length;
+			continue;
+		}
+		else if(si->kind == msg_sysex)
+		{
+			cur->running_status = 0;
+			uint32_t len = 0;
+			cur->pos += 1 + parse_vbl(buf+cur->pos+1, &len);
+			cur->pos += len;
+			continue;
+		}
+		else if(si->kind == msg_meta)
+		{
+			//tempo events were collected before streaming started
+			cur->running_status = 0;
+			uint8_t mtype = buf[cur->pos+1];
+			uint32_t len = 0;
+			cur->pos += 2 + parse_vbl(buf+cur->pos+2, &len);
+			cur->pos += len;
+			if(meta_table[mtype].kind != meta_end || !(send_out & SEND_TRACK_END)) continue;
+			evt_set(evt, 0, cur->track, 0x0F, evt_track_end, 255, 255);
+		}
+		else
+		{
+			cur->tick -= dt; //the byte is read as the next delta time
+			continue;
+		}
+		evt->T = tick_to_time(ctx, cur->tick, &cur->seg);
+		return 1;
+	}
+	return 0;
+}
+
+inline int cursor_before(sParserContext *ctx, int c1, int c2)
+{
+	sMIDI_event *e1 = &ctx->cursors[c1].evt;
+	sMIDI_event *e2 = &ctx->cursors[c2].evt;
+	if(e1->T != e2->T) return e1->T < e2->T;
+	return e1->track < e2->track;
+}
+
+//streaming parse: events go to emit() in the same order sort_events() gives, without being stored.
+//Only tempo events of all tracks are read first, then every track is decoded by its own cursor and the
+//cursors are merged on a heap, so memory depends on the number of tracks and tempo events only
+int stream_midi(sParserContext *ctx, uint8_t *buf, int length, int send_out, void (*emit)(sMIDI_event *evt, void *arg), void *emit_arg)
+{
+	ctx->tempo_map.count = 0;
+	int chunks_count = index_chunks(ctx, buf, length);
+	for(int n = 0; n < chunks_count; n++)
+		parse_chunk_track(ctx, ctx->chunks + n, 0, log_level);
+	tempo_map_build(&ctx->tempo_map);
+
+	if(ctx->cursors_size < chunks_count)
+	{
+		delete[] ctx->cursors;
+		ctx->cursors_size = chunks_count;
+		ctx->cursors = new sTrackCursor[ctx->cursors_size];
+	}
+	if(ctx->heap_size < chunks_count)
+	{
+		delete[] ctx->merge_heap;
+		ctx->heap_size = chunks_count;
+		ctx->merge_heap = new int[ctx->heap_size];
+	}
+
+	int *heap = ctx->merge_heap;
+	int hcount = 0;
+	for(int n = 0; n < chunks_count; n++)
+	{
+		sTrackCursor *cur = ctx->cursors + n;
+		cur->data = ctx->chunks[n].data;
+		cur->length = ctx->chunks[n].length;
+		cur->pos = 0;
+		cur->track = ctx->chunks[n].track;
+		cur->tick = 0;
+		cur->running_status = 0;
+		cur->seg = -1;
+		if(!track_enabled(ctx, cur->track)) continue;
+		if(!track_cursor_next(ctx, cur, send_out)) continue;
+		int c = hcount++;
+		while(c > 0)
+		{
+			int p = (c-1) >> 1;
+			if(!cursor_before(ctx, n, heap[p])) break;
+			heap[c] = heap[p];
+			c = p;
+		}
+		heap[c] = n;
+	}
+
+	int count = 0;
+	while(hcount > 0)
+	{
+		int r = heap[0];
+		emit(&ctx->cursors[r].evt, emit_arg);
+		count++;
+		if(!track_cursor_next(ctx, ctx->cursors + r, send_out))
+			r = heap[--hcount];
+		if(hcount == 0) break;
+		int c = 0;
+		while(1)
+		{
+			int ch = 2*c + 1;
+			if(ch >= hcount) break;
+			if(ch+1 < hcount && cursor_before(ctx, heap[ch+1], heap[ch])) ch++;
+			if(!cursor_before(ctx, heap[ch], r)) break;
+			heap[c] = heap[ch];
+			c = ch;
+		}
+		heap[c] = r;
+	}
+	return count;
+}
+
+
+//regular files are mapped into memory and read by the parser directly, pipes and other
+//streams are read into a growing buffer
+//"-" is stdin
+int open_input(const char *fname)
+{
+	if(str_eq(fname, "-")) return 0;
+	int handle = open(fname, O_RDONLY);
+	if(handle < 0)
+		fprintf(stderr, "can't open file %s!\n", fname);
+	return handle;
+}
+
+void read_handle(sInputFile *in, int handle)
+{
+	in->buf = NULL;
+	in->length = 0;
+	in->mapped = 0;
+	struct stat st;
+	if(fstat(handle, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t len = st.st_size;
+		//reserve a zero page after the file, reading past the end of a file mapping would give SIGBUS
+		in->map_length = (len + page - 1) / page * page + page;
+		void *area = mmap(NULL, in->map_length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(area != MAP_FAILED)
+		{
+			if(mmap(area, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, handle, 0) != MAP_FAILED)
+			{
+				madvise(area, len, MADV_SEQUENTIAL);
+				in->buf = (uint8_t*)area;
+				in->length = len;
+				in->mapped = 1;
+				return;
+			}
+			munmap(area, in->map_length);
+		}
+	}
+
+	if(in->heap == NULL)
+	{
+		in->heap_size = 1<<16;
+		in->heap = new uint8_t[in->heap_size + FILE_TAIL_PADDING];
+	}
+	while(1)
+	{
+		if(in->length == in->heap_size)
+		{
+			in->heap_size *= 2;
+			uint8_t *bb = new uint8_t[in->heap_size + FILE_TAIL_PADDING];
+			memcpy(bb, in->heap, in->length);
+			delete[] in->heap;
+			in->heap = bb;
+		}
+		int res = read(handle, in->heap + in->length, in->heap_size - in->length);
+		if(res < 0)
+		{
+			fprintf(stderr, "file reading error\n");
+			break;
+		}
+		if(res == 0) break;
+		in->length += res;
+	}
+	in->buf = in->heap;
+	memset(in->buf + in->length, 0, FILE_TAIL_PADDING);
+}
+
+void read_file(sInputFile *in, const char *fname)
+{
+	in->buf = NULL;
+	in->length = 0;
+	in->mapped = 0;
+	int handle = open_input(fname);
+	if(handle < 0) return;
+	read_handle(in, handle);
+	if(handle > 0) close(handle);
+}
+
+//the heap buffer stays for the next read_file()
+void close_file(sInputFile *in)
+{
+	if(in->mapped)
+		munmap(in->buf, in->map_length);
+	in->buf = NULL;
+	in->length = 0;
+	in->mapped = 0;
+}
+
+void file_free(sInputFile *in)
+{
+	close_file(in);
+	delete[] in->heap;
+	in->heap = NULL;
+	in->heap_size = 0;
+}
+
+//reader of the binary output, writes the same text save_events() does. Returns number of records or -1
+int binary_to_text(sParserContext *ctx, const char *in_name, const char *out_name)
+{
+	sInputFile *in = &ctx->in;
+	read_file(in, in_name);
+	uint8_t *b = in->buf;
+	if(in->length < BIN_HEADER_SIZE || memcmp(b, BIN_MAGIC, 4) != 0 || get_u16le(b+4) != BIN_VERSION)
+	{
+		fprintf(stderr, "%s is not a binary events file\n", in_name);
+		close_file(in);
+		return -1;
+	}
+	int record_size = get_u16le(b+6);
+	uint32_t count = get_u32le(b+8);
+	if(log_level >= log_info) fprintf(stderr, "%u records, times in %s\n", count, (get_u32le(b+12) & BIN_FLAG_MICROSECONDS) ? "microseconds" : "milliseconds");
+	if(record_size < BIN_RECORD_SIZE || (uint64_t)count * record_size > (uint64_t)(in->length - BIN_HEADER_SIZE))
+	{
+		fprintf(stderr, "%s: bad record size %d or count %u\n", in_name, record_size, count);
+		close_file(in);
+		return -1;
+	}
+	sOutBuf *ob = &ctx->out;
+	if(!out_open(ob, out_name))
+	{
+		close_file(in);
+		return -1;
+	}
+	uint8_t *r = b + BIN_HEADER_SIZE;
+	for(uint32_t n = 0; n < count; n++, r += record_size)
+	{
+		sMIDI_event e;
+		evt_set(&e, get_u32le(r), get_u16le(r+4), r[6] >> 4, r[6] & 0x0F, r[7], (int16_t)get_u16le(r+8));
+		char *p = out_record(ob);
+		p = put_event_fields(p, &e);
+		*p++ = '\n';
+		out_commit(ob, p);
+	}
+	out_close(ob);
+	close_file(in);
+	return ob->failed ? -1 : (int)count;
+}
+
+//incremental reader for pipes and sockets, where the size is not known in advance. Chunks are parsed as
+//soon as they are complete in the buffer, so it holds only the chunk being read, not the whole input.
+//Returns the number of bytes read
+int parse_midi_handle(sParserContext *ctx, int handle, int send_out)
+{
+	sInputFile *in = &ctx->in;
+	if(in->heap == NULL)
+	{
+		in->heap_size = 1<<16;
+		in->heap = new uint8_t[in->heap_size + FILE_TAIL_PADDING];
+	}
+	int first_event = ctx->events_count;
+	ctx->tempo_map.count = 0;
+	int chunks_count = 0;
+	int start = 0, end = 0, total = 0, eof = 0;
+	uint8_t type[5];
+	type[4] = 0;
+	while(1)
+	{
+		//a chunk is parsed when its data and the bytes the parser may look at past it are in the buffer
+		uint64_t need = 8;
+		if(end - start >= 8) need = 8 + (uint64_t)chunk_length(in->heap + start) + FILE_TAIL_PADDING;
+		if(end - start >= (int64_t)need || (eof && end - start >= 8))
+		{
+			uint8_t *buf = in->heap + start;
+			uint32_t len = chunk_length(buf);
+			for(int x = 0; x < 4; x++)
+				type[x] = buf[x];
+			if(log_level >= log_info) fprintf(stderr, "%s: %d\n", type, len);
+			if(8 + (uint64_t)len > (uint64_t)(end - start)) len = end - start - 8; //truncated input
+			if(str_eq((char*)type, "MThd"))
+				parse_header(ctx, buf + 8);
+			if(str_eq((char*)type, "MTrk"))
+			{
+				if(chunks_count == MAX_TRACKS) track_limit_warn();
+				sTrackChunk tc;
+				tc.data = buf + 8;
+				tc.length = len;
+				tc.track = chunks_count++;
+				tc.worker = 0;
+				tc.expected = -1;
+				parse_chunk_track(ctx, &tc, send_out, log_level);
+			}
+			start += 8 + len;
+			continue;
+		}
+		if(eof) break;
+
+		if(start > 0)
+		{
+			memmove(in->heap, in->heap + start, end - start);
+			end -= start;
+			start = 0;
+		}
+		if(end == in->heap_size) //grows as data comes, a broken chunk length can't make it allocate more
+		{
+			in->heap_size *= 2;
+			uint8_t *bb = new uint8_t[in->heap_size + FILE_TAIL_PADDING];
+			memcpy(bb, in->heap, end);
+			delete[] in->heap;
+			in->heap = bb;
+		}
+		int res = read(handle, in->heap + end, in->heap_size - end);
+		if(res < 0)
+		{
+			fprintf(stderr, "file reading error\n");
+			res = 0;
+		}
+		if(res == 0)
+		{
+			eof = 1;
+			memset(in->heap + end, 0, FILE_TAIL_PADDING);
+		}
+		end += res;
+		total += res;
+	}
+
+	tempo_map_build(&ctx->tempo_map);
+	convert_event_times(ctx, first_event);
+	return total;
+}
+
+typedef struct sConvertOptions
+{
+	int send_events;
+	sEventQuery query; //events to save
+	int prevent_overlap;
+	int overlap_master;
+	int need_postprocess;
+	int make_python;
+	int make_binary;
+	int stream; //events are written while tracks are read, see stream_midi()
+	uint32_t time_unit; //microseconds per output time unit, see sParserContext
+	sNoteParams note; //stages of note_postprocessor()
+	int play; //output is a serial device, events are played on it
+	sPlayOptions play_opt;
+}sConvertOptions;
+
+//text output of the streaming path, same lines as save_events()
+typedef struct sTextSink
+{
+	sOutBuf *ob;
+	const sEventQuery *query;
+}sTextSink;
+
+void emit_to_text(sMIDI_event *evt, void *arg)
+{
+	sTextSink *sink = (sTextSink*)arg;
+	if(!query_match(sink->query, evt)) return;
+	char *p = out_record(sink->ob);
+	p = put_event_fields(p, evt);
+	*p++ = '\n';
+	out_commit(sink->ob, p);
+}
+
+void emit_to_overlap(sMIDI_event *evt, void *arg)
+{
+	overlap_push((sOverlapResolver*)arg, *evt);
+}
+
+//streaming conversion, postprocessing needs all events and is not done here.
+//Returns number of events or -1 if the output can't be written
+int stream_file(sParserContext *ctx, sInputFile *in, const char *out_name, sConvertOptions *opt)
+{
+	sTextSink sink;
+	sink.ob = &ctx->out;
+	sink.query = &opt->query;
+	if(!out_open(sink.ob, out_name)) return -1;
+	int count;
+	if(opt->prevent_overlap)
+	{
+		overlap_init(&ctx->overlap, emit_to_text, &sink);
+		count = stream_midi(ctx, in->buf, in->length, opt->send_events, emit_to_overlap, &ctx->overlap);
+		overlap_finish(&ctx->overlap);
+	}
+	else
+		count = stream_midi(ctx, in->buf, in->length, opt->send_events, emit_to_text, &sink);
+	out_close(sink.ob);
+	return sink.ob->failed ? -1 : count;
+}
+
+//read, parse, sort, postprocess and save one file. Returns number of events or -1 if the input can't be read or the output can't be written
+int convert_file(sParserContext *ctx, const char *in_name, const char *out_name, sConvertOptions *opt, uint64_t *in_bytes)
+{
+	sInputFile *in = &ctx->in;
+	int handle = open_input(in_name);
+	if(handle < 0) return -1;
+	parser_reset(ctx);
+	memcpy(ctx->track_set, opt->query.tracks, sizeof(ctx->track_set));
+	ctx->time_unit = opt->time_unit;
+	struct stat st;
+	if(!(opt->stream && !opt->make_python && !opt->make_binary && !opt->play) && fstat(handle, &st) == 0 && !S_ISREG(st.st_mode))
+	{
+		//pipe: tracks are parsed while the input is still coming
+		int bytes = parse_midi_handle(ctx, handle, opt->send_events);
+		if(handle > 0) close(handle);
+		if(bytes < 1) return -1;
+		if(in_bytes) *in_bytes = bytes;
+	}
+	else
+	{
+		read_handle(in, handle);
+		if(handle > 0) close(handle);
+		if(in->length < 1)
+		{
+			close_file(in);
+			return -1;
+		}
+		if(in_bytes) *in_bytes = in->length;
+		if(opt->stream && !opt->make_python && !opt->make_binary && !opt->play)
+		{
+			int count = stream_file(ctx, in, out_name, opt);
+			close_file(in);
+			if(ctx->time_overflow)
+			{
+				fprintf(stderr, "%s: event times don't fit in 32 bits%s, the last ones are clamped\n", in_name, opt->time_unit == 1 ? ", too long for -US" : "");
+				return -1;
+			}
+			return count;
+		}
+		parse_midi(ctx, in->buf, in->length, opt->send_events);
+	}
+	if(ctx->time_overflow)
+	{
+		fprintf(stderr, "%s: event times don't fit in 32 bits%s\n", in_name, opt->time_unit == 1 ? ", too long for -US" : "");
+		close_file(in);
+		return -1;
+	}
+	sort_events(ctx);
+	if(opt->need_postprocess)
+		note_postprocessor(ctx, &opt->note, opt->prevent_overlap);
+	else if(opt->prevent_overlap)
+		process_overlaps(ctx, opt->overlap_master);
+	
+	int res;
+	if(opt->make_python)
+		res = save_python_script(ctx, out_name, &opt->query);
+	else if(opt->play)
+		res = play_events(ctx, out_name, &opt->query, &opt->play_opt);
+	else if(opt->make_binary)
+		res = save_binary(ctx, out_name, &opt->query);
+	else
+		res = save_events(ctx, out_name, &opt->query);
+	
+	close_file(in);
+	return res < 0 ? -1 : ctx->events_count;
+}
+
+//batch mode: many files converted by a pool of workers in one process. Every worker owns a range of
+//the jobs list and its own parser context that is reused for all its files. A worker that has
+//finished its range steals the upper half of the largest range left
+typedef struct sBatch
+{
+	char **in_names;
+	char **out_names;
+	int count;
+	int size;
+	sConvertOptions *opt;
+	struct sBatchWorker *workers;
+	int workers_count;
+}sBatch;
+
+typedef struct sBatchWorker
+{
+	pthread_t thread;
+	sBatch *batch;
+	sParserContext *ctx;
+	uint64_t range; //next job in the low 32 bits, end of the range in the high 32 bits
+	int files_ok;
+	int files_failed;
+	uint64_t bytes;
+	uint64_t events;
+}sBatchWorker;
+
+inline uint64_t batch_range(uint32_t begin, uint32_t end)
+{
+	return ((uint64_t)end << 32) | begin;
+}
+
+int batch_take(sBatchWorker *w)
+{
+	while(1)
+	{
+		uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+		uint32_t begin = r, end = r >> 32;
+		if(begin >= end) return -1;
+		if(__sync_bool_compare_and_swap(&w->range, r, batch_range(begin+1, end))) return begin;
+	}
+}
+
+int batch_steal(sBatchWorker *w)
+{
+	sBatch *b = w->batch;
+	while(1)
+	{
+		sBatchWorker *victim = NULL;
+		uint32_t most = 0;
+		for(int n = 0; n < b->workers_count; n++)
+		{
+			uint64_t r = __atomic_load_n(&b->workers[n].range, __ATOMIC_ACQUIRE);
+			uint32_t begin = r, end = r >> 32;
+			if(begin < end && end - begin > most)
+			{
+				most = end - begin;
+				victim = b->workers + n;
+			}
+		}
+		if(victim == NULL) return 0;
+		uint64_t r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+		uint32_t begin = r, end = r >> 32;
+		if(begin >= end) continue;
+		uint32_t mid = end - (end - begin + 1) / 2;
+		if(__sync_bool_compare_and_swap(&victim->range, r, batch_range(begin, mid)))
+		{
+			//own range is empty and job indexes never repeat, so no thief can change it meanwhile
+			__atomic_store_n(&w->range, batch_range(mid, end), __ATOMIC_RELEASE);
+			return 1;
+		}
+	}
+}
+
+void *batch_worker_run(void *arg)
+{
+	sBatchWorker *w = (sBatchWorker*)arg;
+	sBatch *b = w->batch;
+	while(1)
+	{
+		int job = batch_take(w);
+		if(job < 0)
+		{
+			if(!batch_steal(w)) break;
+			continue;
+		}
+		uint64_t bytes = 0;
+		int res = convert_file(w->ctx, b->in_names[job], b->out_names[job], b->opt, &bytes);
+		if(res < 0)
+			w->files_failed++;
+		else
+		{
+			w->files_ok++;
+			w->bytes += bytes;
+			w->events += res;
+		}
+	}
+	return NULL;
+}
+
+void batch_add(sBatch *b, const char *in_name, const char *out_dir)
+{
+	if(b->count >= b->size)
+	{
+		b->size = b->size ? b->size*2 : 256;
+		char **ii = new char*[b->size];
+		char **oo = new char*[b->size];
+		for(int x = 0; x < b->count; x++)
+		{
+			ii[x] = b->in_names[x];
+			oo[x] = b->out_names[x];
+		}
+		delete[] b->in_names;
+		delete[] b->out_names;
+		b->in_names = ii;
+		b->out_names = oo;
+	}
+	//output name: input file name without directory and extension, in out_dir
+	const char *base = in_name;
+	for(const char *c = in_name; *c; c++)
+		if(*c == '/') base = c+1;
+	int base_len = 0, ext_pos = -1;
+	for(; base[base_len]; base_len++)
+		if(base[base_len] == '.') ext_pos = base_len;
+	if(ext_pos > 0) base_len = ext_pos;
+
+	int in_len = strlen(in_name);
+	b->in_names[b->count] = new char[in_len + 1];
+	memcpy(b->in_names[b->count], in_name, in_len + 1);
+	int out_len = strlen(out_dir) + base_len + 8;
+	b->out_names[b->count] = new char[out_len];
+	snprintf(b->out_names[b->count], out_len, "%s/%.*s%s", out_dir, base_len, base, b->opt->make_python ? ".py" : b->opt->make_binary ? ".bin" : ".txt");
+	b->count++;
+}
+
+int is_midi_name(const char *name)
+{
+	int len = strlen(name);
+	const char *ext[2] = {".mid", ".midi"};
+	for(int e = 0; e < 2; e++)
+	{
+		int el = strlen(ext[e]);
+		if(len <= el) continue;
+		int match = 1;
+		for(int x = 0; x < el; x++)
+		{
+			char c = name[len-el+x];
+			if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+			if(c != ext[e][x]) match = 0;
+		}
+		if(match) return 1;
+	}
+	return 0;
+}
 
-	while(pos < length)
+//input is a directory with .mid files or a text file with one input path per line
+void batch_collect(sBatch *b, const char *input, const char *out_dir)
+{
+	DIR *dir = opendir(input);
+	if(dir)
 	{
-		uint32_t dt;
-		int dpos = parse_vbl(buf+pos, &dt);
-		pos += dpos;
-		uint8_t type = buf[pos]>>4;
-		uint8_t channel = buf[pos]&0x0F;
-		uint8_t b1 = buf[pos+1];
-		uint8_t b2 = buf[pos+2];
-		int handled = 0;
-		uint32_t cur_tempo = 0;
-		double dt_ms = get_dt_ms(T, dt);
-		rT += dt_ms ;//dt * ticks_to_ms;
-		T = rT;
-		sMIDI_event evt;
-		evt.active = 1;
-		evt.T = T;
-		evt.channel = channel;
-		evt.track = track_num;
-		
-//		printf("(%d, %d) ", T, dt_ms);
-//		for(int nn = 0; nn < 16; nn++)
-//			printf("%02X ", buf[pos-dpos+nn]);
-//		printf("\n");
-		if(0)if(buf[pos] < 128 && buf[pos] > 0)
-		{
-			handled = 1;
-			pos += 1;
-		}
-		if(1)if(prev_msg_type != -1 && buf[pos] < 127)
-		{
-//			printf("(%d) controller?\n", T);
-//			pos++;
-			evt.type = prev_msg_type;
-			evt.key = buf[pos];
-			evt.channel = prev_msg_chan;
-			evt.value = buf[pos+1];
-			if(prev_send)
-				add_event(evt);
-			handled = 1;
-			pos++;
-			if(prev_msg_type <= evt_ctrl_change)
-				pos++;//= 3;
-//			else
-//				pos += 1;
+		struct dirent *de;
+		while((de = readdir(dir)) != NULL)
+		{
+			if(!is_midi_name(de->d_name)) continue;
+			int len = strlen(input) + strlen(de->d_name) + 2;
+			char *path = new char[len];
+			snprintf(path, len, "%s/%s", input, de->d_name);
+			batch_add(b, path, out_dir);
+			delete[] path;
 		}
-		if(type >= 0x8 && type < 0xF)
+		closedir(dir);
+		return;
+	}
+	sInputFile list;
+	memset(&list, 0, sizeof(list));
+	read_file(&list, input);
+	int start = 0;
+	for(int x = 0; x <= list.length; x++)
+	{
+		if(x < list.length && list.buf[x] != '\n' && list.buf[x] != '\r') continue;
+		if(x > start)
 		{
-			out_verbose = 0;
-			if(type == 8 || type == 0)
-			{
-				prev_send = 0;
-				if(send_out & SEND_NOTE_OFF)
-				{
-					prev_send = 1;
-					evt.type = evt_note_off;
-					evt.key = b1;
-					evt.value = b2;
-					add_event(evt);
-				}
-				pos += 3;
-				handled = 1;
-				prev_msg_type = evt_note_off;
-				prev_msg_chan = channel;
-			}
-			if(type == 9)
-			{
-				prev_send = 0;
-				if(send_out & SEND_NOTE_ON)
-				{
-					prev_send = 1;
-					evt.type = evt_note_on;
-					evt.key = b1;
-					evt.value = b2;
-					add_event(evt);
-				}
-				pos += 3;
-				handled = 1;
-				prev_msg_type = evt_note_on;
-				prev_msg_chan = channel;
-			}
-			if(type == 0xA)
-			{
-				prev_send = 0;
-				if(send_out & SEND_AFTERTOUCH)
-				{
-					prev_send = 1;
-					evt.type = evt_aftertouch;
-					evt.key = b1;
-					evt.value = b2;
-					add_event(evt);
-				}
-				if(out_verbose) printf("(%d) ch %d aft %d, v %d\n", T, channel, b1, b2);
-				pos += 3;
-				handled = 1;
-				prev_msg_type = evt_aftertouch;
-				prev_msg_chan = channel;
-			}
-			if(type == 0xB)
-			{
-				prev_send = 0;
-				if(send_out & SEND_CTRL_CHANGE)
-				{
-					prev_send = 1;
-					evt.type = evt_ctrl_change;
-					evt.key = b1;
-					evt.value = b2;
-					add_event(evt);
-				}
-				if(out_verbose) printf("(%d) ch %d cc %d, cv %d\n", T, channel, b1, b2);
-				pos += 3;
-				handled = 1;
-				prev_msg_type = evt_ctrl_change;
-				prev_msg_chan = channel;
-			}
-			if(type == 0xC)
-			{
-				prev_send = 0;
-				if(send_out & SEND_PROG_CHANGE)
-				{
-					prev_send = 1;
-					evt.type = evt_prog_change;
-					evt.key = 255;
-					evt.value = b1;
-					add_event(evt);
-				}
-				if(out_verbose) printf("(%d) ch %d prog %d\n", T, channel, b1);
-				pos += 2;
-				handled = 1;
-				prev_msg_type = evt_prog_change;
-				prev_msg_chan = channel;
-			}
-			if(type == 0xD)
-			{
-				prev_send = 0;
-				if(send_out & SEND_CHAN_KEYPRES)
-				{
-					prev_send = 1;
-					evt.type = evt_chan_keypress;
-					evt.key = 255;
-					evt.value = b1;
-					add_event(evt);
-				}
-				
-				if(out_verbose) printf("(%d) ch %d AFT %d\n", T, channel, b1);
-				pos += 2;
-				handled = 1;
-				prev_msg_type = evt_chan_keypress;
-				prev_msg_chan = channel;
-			}
-			if(type == 0xE)
-			{
-				prev_send = 0;
-				if(send_out & SEND_PITCH_BEND)
-				{
-					prev_send = 1;
-					evt.type = evt_pitch_bend;
-					evt.key = 255;
-					evt.value = (b2<<8) + b1;
-					add_event(evt);
-				}
-				if(out_verbose) printf("(%d) ch %d pitch %d\n", T, channel, (b2<<8) + b1);
-				pos += 3;
-				handled = 1;
-				prev_msg_type = evt_pitch_bend;
-				prev_msg_chan = channel;
-			}
+			char *path = new char[x - start + 1];
+			memcpy(path, list.buf + start, x - start);
+			path[x - start] = 0;
+			batch_add(b, path, out_dir);
+			delete[] path;
 		}
-		if(type == 0xF)
+		start = x+1;
+	}
+	file_free(&list);
+}
+
+double time_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int run_batch(const char *input, const char *out_dir, sConvertOptions *opt, int workers_count, int zero_to_off)
+{
+	sBatch b;
+	memset(&b, 0, sizeof(b));
+	b.opt = opt;
+	batch_collect(&b, input, out_dir);
+	if(b.count == 0)
+	{
+		fprintf(stderr, "no input files in %s\n", input);
+		return 1;
+	}
+	if(workers_count > b.count) workers_count = b.count;
+	b.workers_count = workers_count;
+	b.workers = new sBatchWorker[workers_count];
+	for(int w = 0; w < workers_count; w++)
+	{
+		sBatchWorker *bw = b.workers + w;
+		bw->batch = &b;
+		bw->ctx = new sParserContext;
+		parser_init(bw->ctx);
+		bw->ctx->zero_to_off = zero_to_off;
+		bw->range = batch_range((uint64_t)b.count * w / workers_count, (uint64_t)b.count * (w+1) / workers_count);
+		bw->files_ok = bw->files_failed = 0;
+		bw->bytes = bw->events = 0;
+	}
+
+	double t_start = time_now();
+	for(int w = 1; w < workers_count; w++)
+		if(pthread_create(&b.workers[w].thread, NULL, batch_worker_run, b.workers + w) != 0)
+			b.workers[w].thread = 0; //its range is stolen by the others
+	batch_worker_run(b.workers);
+	for(int w = 1; w < workers_count; w++)
+		if(b.workers[w].thread)
+			pthread_join(b.workers[w].thread, NULL);
+	double dt = time_now() - t_start;
+
+	int files_ok = 0, files_failed = 0;
+	uint64_t bytes = 0, events = 0;
+	for(int w = 0; w < workers_count; w++)
+	{
+		files_ok += b.workers[w].files_ok;
+		files_failed += b.workers[w].files_failed;
+		bytes += b.workers[w].bytes;
+		events += b.workers[w].events;
+		parser_free(b.workers[w].ctx);
+		delete b.workers[w].ctx;
+	}
+	if(dt <= 0) dt = 1e-9;
+	fprintf(stderr, "batch: %d files converted, %d failed, %d workers, %.3f s\n", files_ok, files_failed, workers_count, dt);
+	fprintf(stderr, "batch: %.1f files/s, %.2f MB/s input, %.0f events/s\n", files_ok / dt, bytes / dt / 1e6, events / dt);
+
+	for(int x = 0; x < b.count; x++)
+	{
+		delete[] b.in_names[x];
+		delete[] b.out_names[x];
+	}
+	delete[] b.in_names;
+	delete[] b.out_names;
+	delete[] b.workers;
+	return files_failed > 0;
+}
+
+//-BENCHVLQ: number decoders on random numbers of 1-4 bytes and in a pre-scan of the tracks of a file
+template<int (*VLQ)(uint8_t *buf, uint32_t *res)> double bench_vlq_decode(uint8_t *buf, int length, int rounds, uint64_t *sum)
+{
+	double t = time_now();
+	*sum = 0;
+	for(int r = 0; r < rounds; r++)
+	{
+		int pos = 0;
+		while(pos < length)
 		{
-			prev_msg_type = -1;
-			out_verbose = 1;
-			if(channel == 0)
-			{
-				if(out_verbose) printf("(%d) sysex F0\n", T);
-				handled = 1;
-				uint32_t len = 0;
-				int dpos = parse_vbl(buf+pos+1, &len);
-				pos += dpos + len + 1;
-			}
-			if(channel == 1)
-			{
-				if(out_verbose) printf("(%d) MIDI Time Code Qtr. Frame\n", T);
-				handled = 1;
-				pos += 3;
-			}
-			if(channel == 2)
-			{
-				if(out_verbose) printf("(%d) Song Position Pointer\n", T);
-				handled = 1;
-				pos += 3;
-			}
-			if(channel == 3)
-			{
-				if(out_verbose) printf("(%d) Song Select\n", T);
-				handled = 1;
-				pos += 2;
-			}
-			if(channel == 6)
-			{
-				if(out_verbose) printf("(%d) Tune Request\n", T);
-				handled = 1;
-				pos += 1;
-			}
-			if(channel == 7)
-			{ 
-				if(out_verbose) printf("(%d) sysex F7\n", T);
-				handled = 1;
-				uint32_t len = 0;
-				int dpos = parse_vbl(buf+pos+1, &len);
-				pos += dpos + len + 1;
-			}
-			if(channel == 8)
-			{
-				if(out_verbose) printf("(%d) Timing clock\n", T);
-				handled = 1;
-				pos += 1;
-			}
-			if(channel == 0xA)
-			{
-				if(out_verbose) printf("(%d) Start\n", T);
-				handled = 1;
-				pos += 1;
-			}
-			if(channel == 0xB)
-			{
-				if(out_verbose) printf("(%d) Stop\n", T);
-				handled = 1;
-				pos += 1;
-			}
-			if(channel == 0xF) //meta event
-			{
-				uint32_t len = 0;
-				if((b1 >= 1 && b1 <= 9) || b1 == 0x7F || b1 == 0x60)
-				{
-					int dpos = parse_vbl(buf+pos+2, &len);
-//					printf("vbl: %d %d\n", dpos, len);
-					pos += dpos+2;
-//					b1 = buf[pos+1];
-//					b2 = buf[pos+2];
-//					pos++; //b1
-				}
-				
-				if(b1 == 0)
-				{
-					if(out_verbose) printf("(%d) meta 0\n", T); 
-					handled = 1; 
-					pos += 4;
-				}
-				if(b1 == 1)
-				{
-					if(out_verbose)
-					{
-						printf("(%d) meta text: ", T); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 2)
-				{
-					if(out_verbose)
-					{
-						printf("(%d) meta copyright: ", T); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 3)
-				{ 
-					if(out_verbose)
-					{
-						printf("(%d) meta Track Name (%d): ", T, pos); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 4) 
-				{
-					if(out_verbose)
-					{
-						printf("(%d) meta Instrument Name: ", T); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 5)
-				{
-					if(out_verbose)
-					{
-						printf("(%d) meta Lyrics: ", T); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 6) 
-				{
-					if(out_verbose)
-					{
-						printf("(%d) meta Marker: ", T); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 7) 
-				{
-					if(out_verbose)
-					{
-						printf("(%d) meta Cue Point: ", T); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 8) 
-				{
-					if(out_verbose)
-					{
-						printf("(%d) meta Program Name: ", T); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 9) 
-				{
-					if(out_verbose)
-					{
-						printf("(%d) meta Device Name: ", T); 
-						for(int x = 0; x < len; x++) printf("%c", buf[pos+x]);
-						printf("\n");
-					}
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 0x20) 
-				{
-					if(out_verbose) printf("(%d) meta channel prefix\n", T); 
-					handled = 1; 
-					pos += 4;
-				}
-				if(b1 == 0x21) 
-				{
-					if(out_verbose) printf("(%d) meta port prefix\n", T); 
-					handled = 1; 
-					pos += 4;
-				}
-				if(b1 == 0x2F) 
-				{
-					if(out_verbose) printf("(%d) meta track end\n", T); 
-					if(send_out & SEND_TRACK_END)
-					{
-						evt.type = evt_track_end;
-						evt.key = 255;
-						evt.value = 255;
-						add_event(evt);
-					}
-					handled = 1; 
-					pos += 3;
-				}
-				if(b1 == 0x51)
-				{
-					uint32_t mpqn = (buf[pos+3]<<16)|(buf[pos+4]<<8)|buf[pos+5];
-					if(out_verbose) printf("(%d) meta tempo %d\n", T, mpqn);
-					add_tempo_point(T, mpqn);
-					ticks_to_ms = (float)(mpqn / 1000.0) / (float)(ticks_per_qn);
-					
-					handled = 1; 
-					pos += 6;
-				}
-				if(b1 == 0x54) 
-				{
-					if(out_verbose) printf("(%d) meta SMTPE offset\n", T); 
-					handled = 1; 
-					pos += 8;
-				}
-				if(b1 == 0x58) 
-				{
-					if(out_verbose) printf("(%d) meta Time Signature\n", T); 
-					handled = 1; 
-					pos += 7;
-				}
-				if(b1 == 0x59) 
-				{
-					if(out_verbose) printf("(%d) meta Key Signature\n", T); 
-					handled = 1; 
-					pos += 5;
-				}
-				if(b1 == 0x60) 
-				{
-					if(out_verbose) printf("(%d) meta XMF\n", T); 
-					handled = 1; 
-					pos += len;
-				}
-				if(b1 == 0x7F) 
-				{
-					if(out_verbose) printf("(%d) meta Sequencer-Specific\n", T); 
-					handled = 1; 
-					pos += len;
-				}
-				if(!handled) 
-				{
-					if(out_verbose) fprintf(stderr, "unhandled meta: %02X %02X %02X %02X %02X %02X %02X %02X\n", b1, b2, buf[pos+3], buf[pos+4], buf[pos+5], buf[pos+6], buf[pos+7], buf[pos+8]); 
-					pos += len;
-				}
-			}
-			
+			uint32_t v;
+			pos += VLQ(buf + pos, &v);
+			*sum += v;
 		}
-		if(!handled)
-		{ 
-			//if(out_verbose) 
-			//fprintf(stderr, "(%d) unhandled %02X %02X %02X %02X %02X %02X %02X %02X\n", T, buf[pos-2], buf[pos-1], buf[pos], buf[pos+1], buf[pos+2], buf[pos+3], buf[pos+4], buf[pos+5]); 
-			printf("(%d, %d) unhandled ", T, pos);
-			for(int nn = 0; nn < 16; nn++)
-				printf("%02X ", buf[pos-3+nn]);
-			printf("\n");
-			
-			unhandled_sum++;
-			
-			rT -= dt_ms;
+	}
+	return time_now() - t;
+}
+
+template<int (*VLQ)(uint8_t *buf, uint32_t *res)> double bench_vlq_prescan(sParserContext *ctx, int chunks_count, int rounds, uint64_t *sum)
+{
+	double t = time_now();
+	*sum = 0;
+	for(int r = 0; r < rounds; r++)
+		for(int n = 0; n < chunks_count; n++)
+			*sum += prescan_track<VLQ>(ctx->chunks[n].data, ctx->chunks[n].length, 0xFF);
+	return time_now() - t;
+}
+
+int bench_vlq(sParserContext *ctx, const char *in_name, const char *out_name)
+{
+	sOutBuf *ob = &ctx->out;
+	if(!out_open(ob, out_name)) return 1;
+	int failed = 0;
+
+	//numbers with 1 byte mostly, like delta times, and some of 2-4 bytes
+	int count = 1<<20;
+	uint8_t *buf = new uint8_t[count*4 + FILE_TAIL_PADDING];
+	int length = 0;
+	uint32_t seed = 12345;
+	for(int n = 0; n < count; n++)
+	{
+		seed = seed * 1103515245 + 12345;
+		int bytes = (seed >> 16) % 10;
+		bytes = bytes < 6 ? 1 : bytes < 8 ? 2 : bytes < 9 ? 3 : 4;
+		seed = seed * 1103515245 + 12345;
+		uint32_t v = (seed >> 4) & ((1u << (7*bytes)) - 1);
+		for(int b = bytes-1; b >= 0; b--)
+			buf[length++] = ((v >> (7*b)) & 0x7F) | (b ? 0x80 : 0);
+	}
+	memset(buf + length, 0, FILE_TAIL_PADDING);
+	uint64_t sum_scalar, sum_fast;
+	double t_scalar = bench_vlq_decode<parse_vbl_scalar>(buf, length, 20, &sum_scalar);
+	double t_fast = bench_vlq_decode<parse_vbl>(buf, length, 20, &sum_fast);
+	if(sum_scalar != sum_fast) failed = 1;
+	char line[OUT_MAX_RECORD];
+	int len = snprintf(line, sizeof(line), "random numbers: scalar %.2f ns, fast %.2f ns per number%s\n",
+		t_scalar * 1e9 / (20.0 * count), t_fast * 1e9 / (20.0 * count), sum_scalar != sum_fast ? ", RESULTS DIFFER" : "");
+	out_write(ob, line, len);
+	delete[] buf;
+
+	sInputFile *in = &ctx->in;
+	read_file(in, in_name);
+	if(in->length > 0)
+	{
+		int chunks_count = index_chunks(ctx, in->buf, in->length);
+		int rounds = 1 + (50<<20) / in->length;
+		t_scalar = bench_vlq_prescan<parse_vbl_scalar>(ctx, chunks_count, rounds, &sum_scalar);
+		t_fast = bench_vlq_prescan<parse_vbl>(ctx, chunks_count, rounds, &sum_fast);
+		if(sum_scalar != sum_fast) failed = 1;
+		len = snprintf(line, sizeof(line), "tracks pre-scan: scalar %.1f MB/s, fast %.1f MB/s, %d events%s\n",
+			in->length * (double)rounds / t_scalar / 1e6, in->length * (double)rounds / t_fast / 1e6,
+			(int)(sum_fast / rounds), sum_scalar != sum_fast ? ", RESULTS DIFFER" : "");
+		out_write(ob, line, len);
+	}
+	close_file(in);
+	out_close(ob);
+	return failed;
+}
+
+//-PLAYTEST: playback into a pseudo-terminal, a thread on the other side stands in for the device. It answers
+//like the device does, binary frames go through the reference decoder, and keeps what arrived when. That
+//is written to the output with the arrival of every event against its time in us
+typedef struct sPlayDevice
+{
+	int handle; //master side of the pty
+	int binary;
+	int reject_every; //binary: about one of n frames is taken as damaged, 0 - none
+	uint32_t seed; //picks them, a fixed pattern could hit the same frame every time it's sent again
+	char *records; //received events as text, '\n' after each
+	int records_len;
+	int records_size;
+	int64_t *arrival;
+	int count;
+	int size;
+	uint8_t *in; //binary: bytes of frames not complete yet
+	int in_len;
+	int in_size;
+	uint8_t expected; //sequence number of the next frame
+	int frames;
+	int rejected;
+}sPlayDevice;
+
+//room for another record of up to len bytes
+void play_device_reserve(sPlayDevice *d, int len)
+{
+	if(d->records_len + len > d->records_size)
+	{
+		d->records_size = d->records_size ? d->records_size*2 : 65536;
+		char *rr = new char[d->records_size];
+		if(d->records_len > 0) memcpy(rr, d->records, d->records_len);
+		delete[] d->records;
+		d->records = rr;
+	}
+	if(d->count >= d->size)
+	{
+		d->size = d->size ? d->size*2 : 1024;
+		int64_t *aa = new int64_t[d->size];
+		if(d->count > 0) memcpy(aa, d->arrival, d->count * sizeof(int64_t));
+		delete[] d->arrival;
+		d->arrival = aa;
+	}
+}
+
+void play_device_text(sPlayDevice *d, char *buf, int len, int64_t now, int *in_record)
+{
+	for(int x = 0; x < len; x++)
+	{
+		play_device_reserve(d, 2);
+		if(buf[x] == '<')
+		{
+			*in_record = 1;
+			continue;
+		}
+		if(!*in_record) continue;
+		if(buf[x] != '>')
+		{
+			d->records[d->records_len++] = buf[x];
+			continue;
 		}
+		*in_record = 0;
+		d->records[d->records_len++] = '\n';
+		d->arrival[d->count++] = now;
+		if(d->count > 1) write_all(d->handle, "ok\n", 3); //the reset record is not answered
 	}
-	fprintf(stderr, "unhandled messages: %d\n", unhandled_sum);
 }
 
-void parse_midi(uint8_t *buf, int length, int send_out)
+void play_device_frames(sPlayDevice *d, char *buf, int len, int64_t now, int *nak_sent)
 {
+	if(d->in_len + len > d->in_size)
+	{
+		d->in_size = (d->in_len + len) * 2;
+		uint8_t *ii = new uint8_t[d->in_size];
+		if(d->in_len > 0) memcpy(ii, d->in, d->in_len);
+		delete[] d->in;
+		d->in = ii;
+	}
+	memcpy(d->in + d->in_len, buf, len);
+	d->in_len += len;
+
 	int pos = 0;
-	uint8_t type[5];
-	type[4] = 0;
-	int cur_track = 0;
-	while(pos < length)
+	while(pos < d->in_len)
 	{
-		uint32_t len;
-		for(int x = 0; x < 4; x++)
-			type[x] = buf[pos + x];
-		len = buf[pos+4]; len <<= 8;
-		len += buf[pos+5]; len <<= 8;
-		len += buf[pos+6]; len <<= 8;
-		len += buf[pos+7];
-		fprintf(stderr, "%s: %d\n", type, len);
-		if(str_eq((char*)type, "MThd"))
+		sMIDI_event events[WIRE_MAX_EVENTS];
+		uint8_t seq;
+		int count;
+		int res = wire_decode(d->in + pos, d->in_len - pos, &seq, events, &count);
+		if(res == 0) break;
+		uint8_t answer[2];
+		answer[0] = WIRE_NAK;
+		answer[1] = d->expected;
+		if(res < 0)
 		{
-			int format = (buf[pos+8]<<8) | buf[pos+8+1];
-			int tracks = (buf[pos+8+2]<<8) | buf[pos+8+3];
-			int tpqn_type = !(buf[pos+8+4] > 0x7F);
-			int tpqn = (buf[pos+8+4]<<8) | buf[pos+8+5];
-			int fps = buf[pos+8+4]&0x7F;
-			int tpf = buf[pos+8+5];
-
-			if(tpqn_type)
-			{
-				fprintf(stderr, "MIDI format %d, tracks %d, tpqn %d\n", format, tracks, tpqn);
-				ticks_per_qn = tpqn;
-				tempo_fixed = 0;
-			}
-			else
-			{
-				fprintf(stderr, "MIDI format %d, tracks %d, fps %d, tpf %d\n", format, tracks, fps, tpf);
-				ticks_to_ms = (float)(tpf * fps) / 1000.0;
-				tempo_fixed = 1;
-			}
+			//damaged, its number is not known: asks for the expected frame once and looks for the next sync bytes
+			if(!*nak_sent) write_all(d->handle, answer, 2);
+			*nak_sent = 1;
+			pos++;
+			continue;
 		}
-		if(str_eq((char*)type, "MTrk"))
-		{ 
-			parse_track(buf + pos + 8, len, send_out, cur_track);
-			cur_track++;
+		pos += res;
+		d->frames++;
+		d->seed = d->seed * 1103515245 + 12345;
+		if(d->reject_every > 0 && (d->seed >> 16) % d->reject_every == 0)
+		{
+			d->rejected++;
+			if(seq == d->expected) write_all(d->handle, answer, 2); //again if it was sent again
+			*nak_sent = 1;
+			continue;
 		}
-		pos += 8 + len;
-		
+		if(seq != d->expected) continue; //after a damaged frame, it's sent again
+		for(int n = 0; n < count; n++)
+		{
+			play_device_reserve(d, OUT_MAX_RECORD);
+			char *p = put_event_fields(d->records + d->records_len, events + n);
+			*p++ = '\n';
+			d->records_len = p - d->records;
+			d->arrival[d->count++] = now;
+		}
+		answer[0] = WIRE_ACK;
+		answer[1] = seq;
+		write_all(d->handle, answer, 2);
+		d->expected++;
+		*nak_sent = 0;
 	}
+	memmove(d->in, d->in + pos, d->in_len - pos);
+	d->in_len -= pos;
 }
 
-uint8_t *file_buf;
-int file_length = 0;
+void *play_device_run(void *arg)
+{
+	sPlayDevice *d = (sPlayDevice*)arg;
+	char buf[4096];
+	int state = 0; //inside a text record, or a NAK was sent for the expected frame
+	int res;
+	while((res = read(d->handle, buf, sizeof(buf))) > 0) //EIO when the player and the harness closed the tty
+	{
+		if(d->binary)
+			play_device_frames(d, buf, res, clock_ns(), &state);
+		else
+			play_device_text(d, buf, res, clock_ns(), &state);
+	}
+	return NULL;
+}
 
-void read_file(const char *fname)
+int play_test(sParserContext *ctx, const char *in_name, const char *out_name, sConvertOptions *opt, int reject_every)
 {
-	int handle = open(fname, O_RDONLY);
-	if(handle < 1)
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	char slave_name[256];
+	if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || ptsname_r(master, slave_name, sizeof(slave_name)) != 0)
 	{
-		fprintf(stderr, "can't open file!\n");
-		return;
+		fprintf(stderr, "can't create a pseudo-terminal\n");
+		if(master >= 0) close(master);
+		return 1;
+	}
+	int slave = open(slave_name, O_RDWR | O_NOCTTY); //kept open, the device side would get EIO before the player opens it
+	sPlayDevice d;
+	memset(&d, 0, sizeof(d));
+	d.handle = master;
+	d.binary = opt->play_opt.binary;
+	d.reject_every = reject_every;
+	pthread_t thread;
+	if(slave < 0 || pthread_create(&thread, NULL, play_device_run, &d) != 0)
+	{
+		fprintf(stderr, "can't start the device thread\n");
+		if(slave >= 0) close(slave);
+		close(master);
+		return 1;
 	}
-	lseek(handle, 0, 0);
-	file_length = lseek(handle, 0, 2);
-	lseek(handle, 0, 0);
+	opt->play_opt.wait = 0; //the stand-in doesn't restart
+	int res = convert_file(ctx, in_name, slave_name, opt, NULL);
+	close(slave);
+	pthread_join(thread, NULL);
+	close(master);
 
-	file_buf = new uint8_t[file_length];
-	if(read(handle, file_buf, file_length) != file_length)
+	sPlayStats *st = &ctx->play;
+	sOutBuf *ob = &ctx->out;
+	if(res >= 0 && out_open(ob, out_name))
 	{
-		fprintf(stderr, "file reading error\n");
+		int64_t unit_ns = (int64_t)ctx->time_unit * 1000;
+		int64_t min = 0, max = 0, sum = 0;
+		char *r = d.records;
+		for(int n = 0; n < d.count; n++)
+		{
+			char *end = (char*)memchr(r, '\n', d.records + d.records_len - r);
+			if(n > 0)
+			{
+				uint32_t T = strtoul(r, NULL, 10);
+				int64_t late = d.arrival[n] - (st->start_ns + (int64_t)(T - st->first_T) * unit_ns);
+				if(n == 1 || late < min) min = late;
+				if(n == 1 || late > max) max = late;
+				sum += late;
+				char *p = out_record(ob);
+				memcpy(p, r, end - r);
+				p += end - r;
+				*p++ = ',';
+				if(late < 0)
+				{
+					*p++ = '-';
+					late = -late;
+				}
+				p = put_uint(p, late / 1000);
+				*p++ = '\n';
+				out_commit(ob, p);
+			}
+			r = end + 1;
+		}
+		out_close(ob);
+		if(d.count > 1)
+			fprintf(stderr, "device: %d records, arrival against event time min %.3f ms, mean %.3f ms, max %.3f ms\n",
+				d.count - 1, min * 1e-6, sum * 1e-6 / (d.count - 1), max * 1e-6);
+		if(d.binary)
+			fprintf(stderr, "device: %d frames, %d taken as damaged\n", d.frames, d.rejected);
+		if(d.count - 1 != st->events)
+			fprintf(stderr, "device: %d events were sent\n", st->events);
 	}
-	close(handle);
+	int failed = res < 0 || d.count - 1 != st->events;
+	delete[] d.records;
+	delete[] d.arrival;
+	delete[] d.in;
+	return failed;
+}
+
+//number in [lo, hi] at *c, which is moved past it. Returns 0 if there is no digit or it's out of range
+int parse_number(const char **c, long lo, long hi, long *res)
+{
+	if(**c < '0' || **c > '9') return 0;
+	*res = strtol(*c, (char**)c, 10);
+	return *res >= lo && *res <= hi;
+}
+
+void print_usage()
+{
+	printf("\nMIDI file parser v1.0\nusage: midi_parser -flags <input filename> <output filename>\n");
+	printf("input filename - reads stdin, output filename - writes stdout (diagnostic messages go to stderr then)\n");
+	printf("flags define which MIDI events from which tracks will and will not be stored\n");
+	printf("track flags starts with -t to enable track\n");
+	printf("-t1 -t2 will enable first and second tracks, tracks 1-256, other tracks are read only for tempo\n");
+	printf("-tall will enable all tracks (default option)\n");
+	printf("event flag starts with -e to disable, -E to enable event\n");
+	printf("events:\n");
+	printf("\tNOFF - Note Off (code %d)\n", evt_note_off);
+	printf("\tNON - Note On (code %d)\n", evt_note_on);
+	printf("\tAFT - Aftertouch (code %d)\n", evt_aftertouch);
+	printf("\tCC - Controller Change (code %d)\n", evt_ctrl_change);
+	printf("\tPC - Program Change (code %d)\n", evt_prog_change);
+	printf("\tCKP - Channel Key Pressure (code %d)\n", evt_chan_keypress);
+	printf("\tPB - Pitch Bend (code %d)\n", evt_pitch_bend);
+	printf("\tTE - Track End (code %d)\n", evt_track_end);
+
+	printf("\n\nAdditional options:\n");
+	printf("\tCUTOVP - cut overlapping notes\n");
+	printf("\t0toOFF - convert note on event with stroke value 0 into note off event with stroke value 0\n");		
+	printf("\tQUIET - no diagnostic messages, only errors\n");
+	printf("\tINFO - only per file and per track diagnostic messages\n");
+	printf("\tLOG=<filename> - write diagnostic messages into a file instead of stdout\n");
+	printf("\tTHREADS=<n> - parse tracks on n threads, per event diagnostic messages are off then\n");
+	printf("\tBATCH - convert many files: input is a directory with .mid files or a text file with one path\n");
+	printf("\t\tper line, output is a directory. Files are converted on THREADS workers (all CPUs by default)\n");
+	printf("\tSTREAM - write events while tracks are read, without keeping them in memory (not with PYTHON, BIN)\n");
+	printf("\tBIN - write events in the binary format (see README) instead of text\n");
+	printf("\tREADBIN - input is a binary events file, it's written back as text\n");
+	printf("\tBENCHVLQ - compare number decoders on random data and on the tracks of the input, report goes to output\n");
+	printf("\tCH=<list> - save only events of these channels, 0-15 as in the output, e.g. CH=0,9\n");
+	printf("\tKEYS=<from>-<to> - save only events with keys in the range (keyless events have key 255)\n");
+	printf("\tTIME=<from>-<to> - save only events within the time window, in output time units\n");
+	printf("\tUS - times in microseconds instead of milliseconds, up to about 71 minutes\n");
+	printf("\tPLAY - output is a serial device (115200 baud), the PYTHON events are played on it in real time\n");
+	printf("\tPLAYTEST - PLAY into a pseudo-terminal with a stand-in device, output gets what it received and when\n");
+	printf("\tLOOKAHEAD=<ms> - PLAY: events are sent this much before their time (default %d)\n", PLAY_LOOKAHEAD);
+	printf("\tPLAYWINDOW=<n> - PLAY: events sent before an answer of the device (default %d, 0 - don't wait)\n", PLAY_WINDOW);
+	printf("\tPLAYBIN - PLAY: binary frames of several events instead of text records (see README), PLAYWINDOW counts frames\n");
+	printf("\tPLAYTESTERR=<n> - PLAYTEST: the device takes about one of n binary frames as damaged, it's sent again\n");
+	printf("\tPLAYWAIT=<ms> - PLAY: wait after opening the device, it restarts (default %d)\n", PLAY_WAIT);
+	printf("\tNOTEGAP=<ms> - PYTHON: release of a note pressed again within this gap is moved earlier (default %d, 0 - off)\n", MIN_NOTE_GAP);
+	printf("\tNOTELEN=<ms> - PYTHON: notes shortened below this length get louder (default %d, 0 - off)\n", MIN_NOTE_LENGTH);
+	printf("\tNOTEHOLD=<ms> - PYTHON: hold note on this long after the press of a longer note (default %d, 0 - off)\n", NOTE_ON_TO_HOLD);
+
+	printf("\nBy default, events Note On, Note off and Track End are stored, all others ignored\n");
+	printf("example:\n");
+
+	printf("midi_parser -t2 -eNON -eNOFF -ECC -EPC -EPB input.mid output.txt\n");
+	printf("this command will store only Controller Change, Program Change and Pitch Bend events on track 2\n");
+
+	printf("\nOutput format: time in milliseconds (microseconds with -US), track, channel, type, key, value\n");
+	printf("For events that are not related to a specific key, key field is set to 255\n");
+	printf("For events that don't have valid value, it is set to 255\n");
+	printf("\n");
 }
 
 int main(int argc, char **argv)
 {
 	if(argc < 3)
 	{
-		printf("\nMIDI file parser v1.0\nusage: midi_parser -flags <input filename> <output filename>\n");
-		printf("flags define which MIDI events from which tracks will and will not be stored\n");
-		printf("track flags starts with -t to enable track\n");
-		printf("-t1 -t2 will enable first and second tracks\n");
-		printf("-tall will enable all tracks (default option)\n");
-		printf("event flag starts with -e to disable, -E to enable event\n");
-		printf("events:\n");
-		printf("\tNOFF - Note Off (code %d)\n", evt_note_off);
-		printf("\tNON - Note On (code %d)\n", evt_note_on);
-		printf("\tAFT - Aftertouch (code %d)\n", evt_aftertouch);
-		printf("\tCC - Controller Change (code %d)\n", evt_ctrl_change);
-		printf("\tPC - Program Change (code %d)\n", evt_prog_change);
-		printf("\tCKP - Channel Key Pressure (code %d)\n", evt_chan_keypress);
-		printf("\tPB - Pitch Bend (code %d)\n", evt_pitch_bend);
-		printf("\tTE - Track End (code %d)\n", evt_track_end);
-
-		printf("\n\nAdditional options:\n");
-		printf("\tCUTOVP - cut overlapping notes\n");
-		printf("\t0toOFF - convert note on event with stroke value 0 into note off event with stroke value 0\n");		
-
-		printf("\nBy default, events Note On, Note off and Track End are stored, all others ignored\n");
-		printf("example:\n");
-
-		printf("midi_parser -t2 -eNON -eNOFF -ECC -EPC -EPB input.mid output.txt\n");
-		printf("this command will store only Controller Change, Program Change and Pitch Bend events on track 2\n");
-
-		printf("\nOutput format: time in milliseconds, track, channel, type, key, value\n");
-		printf("For events that are not related to a specific key, key field is set to 255\n");
-		printf("For events that don't have valid value, it is set to 255\n");
-		printf("\n");
-		
+		print_usage();
 		return 1;
 	}
 	
-	int send_events = SEND_NOTE_ON | SEND_NOTE_OFF | SEND_TRACK_END;
+	sConvertOptions opt;
+	opt.send_events = SEND_NOTE_ON | SEND_NOTE_OFF | SEND_TRACK_END;
+	query_init(&opt.query);
+	int tracks_given = 0;
+	opt.prevent_overlap = 0;
+	opt.overlap_master = 1;
+	opt.need_postprocess = 0;
+	opt.make_python = 0;
+	opt.make_binary = 0;
+	opt.stream = 0;
+	opt.time_unit = 1000;
+	note_params_init(&opt.note);
+	opt.play = 0;
+	opt.play_opt.lookahead = PLAY_LOOKAHEAD;
+	opt.play_opt.window = PLAY_WINDOW;
+	opt.play_opt.wait = PLAY_WAIT;
+	opt.play_opt.binary = 0;
+	sParserContext *ctx = new sParserContext;
+	parser_init(ctx);
 	
-	uint64_t track_mask = 0;
-	int prevent_overlap = 0;
-	int overlap_master = 1;
-	int need_postprocess = 0;
-	int make_python = 0;
+	const char *log_fname = NULL;
+	int batch = 0;
+	int read_binary = 0;
+	int benchmark_vlq = 0;
+	int playback_test = 0;
+	int reject_every = 0;
+	int threads = 0;
+	const char *bad_option = NULL;
 
 	for(int a = 1; a < argc-2; a++)
 	{
-		if(str_eq(argv[a], "-eNON")) send_events &= ~SEND_NOTE_ON;
-		if(str_eq(argv[a], "-ENON")) send_events |= SEND_NOTE_ON;
-		if(str_eq(argv[a], "-eNOFF")) send_events &= ~SEND_NOTE_OFF;
-		if(str_eq(argv[a], "-ENOFF")) send_events |= SEND_NOTE_OFF;
-		if(str_eq(argv[a], "-eAFT")) send_events &= ~SEND_AFTERTOUCH;
-		if(str_eq(argv[a], "-EAFT")) send_events |= SEND_AFTERTOUCH;
-		if(str_eq(argv[a], "-eCC")) send_events &= ~SEND_CTRL_CHANGE;
-		if(str_eq(argv[a], "-ECC")) send_events |= SEND_CTRL_CHANGE;
-		if(str_eq(argv[a], "-ePC")) send_events &= ~SEND_PROG_CHANGE;
-		if(str_eq(argv[a], "-EPC")) send_events |= SEND_PROG_CHANGE;
-		if(str_eq(argv[a], "-eCKP")) send_events &= ~SEND_CHAN_KEYPRES;
-		if(str_eq(argv[a], "-ECKP")) send_events |= SEND_CHAN_KEYPRES;
-		if(str_eq(argv[a], "-ePB")) send_events &= ~SEND_PITCH_BEND;
-		if(str_eq(argv[a], "-EPB")) send_events |= SEND_PITCH_BEND;
-		if(str_eq(argv[a], "-eTE")) send_events &= ~SEND_TRACK_END;
-		if(str_eq(argv[a], "-ETE")) send_events |= SEND_TRACK_END;
+		if(str_eq(argv[a], "-eNON")) opt.send_events &= ~SEND_NOTE_ON;
+		if(str_eq(argv[a], "-ENON")) opt.send_events |= SEND_NOTE_ON;
+		if(str_eq(argv[a], "-eNOFF")) opt.send_events &= ~SEND_NOTE_OFF;
+		if(str_eq(argv[a], "-ENOFF")) opt.send_events |= SEND_NOTE_OFF;
+		if(str_eq(argv[a], "-eAFT")) opt.send_events &= ~SEND_AFTERTOUCH;
+		if(str_eq(argv[a], "-EAFT")) opt.send_events |= SEND_AFTERTOUCH;
+		if(str_eq(argv[a], "-eCC")) opt.send_events &= ~SEND_CTRL_CHANGE;
+		if(str_eq(argv[a], "-ECC")) opt.send_events |= SEND_CTRL_CHANGE;
+		if(str_eq(argv[a], "-ePC")) opt.send_events &= ~SEND_PROG_CHANGE;
+		if(str_eq(argv[a], "-EPC")) opt.send_events |= SEND_PROG_CHANGE;
+		if(str_eq(argv[a], "-eCKP")) opt.send_events &= ~SEND_CHAN_KEYPRES;
+		if(str_eq(argv[a], "-ECKP")) opt.send_events |= SEND_CHAN_KEYPRES;
+		if(str_eq(argv[a], "-ePB")) opt.send_events &= ~SEND_PITCH_BEND;
+		if(str_eq(argv[a], "-EPB")) opt.send_events |= SEND_PITCH_BEND;
+		if(str_eq(argv[a], "-eTE")) opt.send_events &= ~SEND_TRACK_END;
+		if(str_eq(argv[a], "-ETE")) opt.send_events |= SEND_TRACK_END;
 		
 		if(argv[a][0] == '-' && argv[a][1] == 't')
 		{
 			int tnum = 0;
-			if(argv[a][2] >= '0' && argv[a][2] <= '9') tnum += argv[a][2]-'0';
-			if(argv[a][3] >= '0' && argv[a][3] <= '9') tnum = tnum*10 + argv[a][3]-'0';
-			if(tnum > 0 && tnum < 65) track_mask |= (1<<(tnum-1));
+			for(int d = 2; d < 5 && argv[a][d] >= '0' && argv[a][d] <= '9'; d++)
+				tnum = tnum*10 + argv[a][d]-'0';
+			if(tnum > 0 && tnum <= 256)
+			{
+				if(!tracks_given) memset(opt.query.tracks, 0, sizeof(opt.query.tracks));
+				tracks_given = 1;
+				opt.query.tracks[(tnum-1) >> 5] |= 1u << ((tnum-1) & 31);
+			}
 		}
 		
-		if(str_eq(argv[a], "-CUTOVP")) prevent_overlap = 1;
-		if(str_eq(argv[a], "-0toOFF")) zero_to_off = 1;
+		if(str_eq(argv[a], "-CUTOVP")) opt.prevent_overlap = 1;
+		if(str_eq(argv[a], "-0toOFF")) ctx->zero_to_off = 1;
+		if(str_eq(argv[a], "-QUIET")) log_level = log_quiet;
+		if(str_eq(argv[a], "-INFO")) log_level = log_info;
+		if(str_prefix(argv[a], "-LOG=")) log_fname = str_prefix(argv[a], "-LOG=");
+		if(str_prefix(argv[a], "-THREADS=")) threads = atoi(str_prefix(argv[a], "-THREADS="));
+		if(str_eq(argv[a], "-BATCH")) batch = 1;
+		if(str_eq(argv[a], "-STREAM")) opt.stream = 1;
+		if(str_eq(argv[a], "-BIN")) opt.make_binary = 1;
+		if(str_eq(argv[a], "-US")) opt.time_unit = 1;
+		//note postprocessor intervals in milliseconds, 0 turns the stage off
+		if(str_prefix(argv[a], "-NOTEGAP="))
+		{
+			opt.note.min_note_gap = atoi(str_prefix(argv[a], "-NOTEGAP="));
+			if(opt.note.min_note_gap == 0) opt.note.stages &= ~(POST_RELEASE | POST_BOOST);
+		}
+		if(str_prefix(argv[a], "-NOTELEN="))
+		{
+			opt.note.min_note_length = atoi(str_prefix(argv[a], "-NOTELEN="));
+			if(opt.note.min_note_length == 0) opt.note.stages &= ~POST_BOOST;
+		}
+		if(str_prefix(argv[a], "-NOTEHOLD="))
+		{
+			opt.note.note_on_to_hold = atoi(str_prefix(argv[a], "-NOTEHOLD="));
+			if(opt.note.note_on_to_hold == 0) opt.note.stages &= ~POST_HOLD;
+		}
+		if(str_eq(argv[a], "-READBIN")) read_binary = 1;
+		if(str_eq(argv[a], "-BENCHVLQ")) benchmark_vlq = 1;
+		if(str_prefix(argv[a], "-CH="))
+		{
+			//list of channels, 0-15 as in the output
+			opt.query.channels = 0;
+			const char *c = str_prefix(argv[a], "-CH=");
+			long ch;
+			int ok;
+			while((ok = parse_number(&c, 0, 15, &ch)))
+			{
+				opt.query.channels |= 1 << ch;
+				if(*c != ',') break;
+				c++;
+			}
+			if(!ok || *c) bad_option = argv[a];
+		}
+		if(str_prefix(argv[a], "-KEYS="))
+		{
+			const char *c = str_prefix(argv[a], "-KEYS=");
+			long from = 0, to = 255;
+			int ok = parse_number(&c, 0, 255, &from);
+			if(ok && *c == '-')
+			{
+				c++;
+				ok = parse_number(&c, from, 255, &to);
+			}
+			if(!ok || *c) bad_option = argv[a];
+			opt.query.key_min = from;
+			opt.query.key_max = to;
+		}
+		if(str_prefix(argv[a], "-TIME="))
+		{
+			const char *c = str_prefix(argv[a], "-TIME=");
+			opt.query.time_min = strtoul(c, (char**)&c, 10);
+			if(*c == '-') opt.query.time_max = strtoul(c+1, NULL, 10);
+		}
 
 		if(str_eq(argv[a], "-PYTHON"))
 		{
-			send_events = SEND_NOTE_ON | SEND_NOTE_OFF | SEND_TRACK_END;
-			prevent_overlap = 1;
-			zero_to_off = 1;
-			need_postprocess = 1;
-			make_python = 1;
+			opt.send_events = SEND_NOTE_ON | SEND_NOTE_OFF | SEND_TRACK_END;
+			opt.prevent_overlap = 1;
+			ctx->zero_to_off = 1;
+			opt.need_postprocess = 1;
+			opt.make_python = 1;
+		}
+		if(str_eq(argv[a], "-PLAY") || str_eq(argv[a], "-PLAYTEST"))
+		{
+			//events of the python script, played instead
+			opt.send_events = SEND_NOTE_ON | SEND_NOTE_OFF | SEND_TRACK_END;
+			opt.prevent_overlap = 1;
+			ctx->zero_to_off = 1;
+			opt.need_postprocess = 1;
+			opt.play = 1;
+			if(str_eq(argv[a], "-PLAYTEST")) playback_test = 1;
 		}
+		if(str_prefix(argv[a], "-LOOKAHEAD=")) opt.play_opt.lookahead = atoi(str_prefix(argv[a], "-LOOKAHEAD="));
+		if(str_prefix(argv[a], "-PLAYWINDOW=")) opt.play_opt.window = atoi(str_prefix(argv[a], "-PLAYWINDOW="));
+		if(str_prefix(argv[a], "-PLAYWAIT=")) opt.play_opt.wait = atoi(str_prefix(argv[a], "-PLAYWAIT="));
+		if(str_eq(argv[a], "-PLAYBIN")) opt.play_opt.binary = 1;
+		if(str_prefix(argv[a], "-PLAYTESTERR=")) reject_every = atoi(str_prefix(argv[a], "-PLAYTESTERR="));
+	}
+	if(bad_option)
+	{
+		fprintf(stderr, "bad value in %s\n", bad_option);
+		print_usage();
+		parser_free(ctx);
+		delete ctx;
+		return 1;
 	}
-	if(track_mask == 0) track_mask = 0xFFFFFFFFFFFFFFFF;
-
-	read_file(argv[argc-2]);
-	if(file_length < 1) return 1;
 
-	parse_midi(file_buf, file_length, send_events);
-	sort_events();
-	if(prevent_overlap)
-		process_overlaps(overlap_master);
-	
-	if(need_postprocess)
-		note_postprocessor();
-	
-	if(make_python)
-		save_python_script(argv[argc-1], track_mask);
+	//diagnostics of several files would be interleaved, the log is not shared between threads
+	if(batch) log_level = log_quiet;
+	//events written to stdout must not be mixed with diagnostics, nor the -PLAYTEST report
+	log_open(log_fname, (str_eq(argv[argc-1], "-") || playback_test) ? 2 : 1);
+	int res;
+	if(batch)
+	{
+		if(threads < 1) threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if(threads < 1) threads = 1;
+		res = run_batch(argv[argc-2], argv[argc-1], &opt, threads, ctx->zero_to_off);
+	}
+	else if(benchmark_vlq)
+		res = bench_vlq(ctx, argv[argc-2], argv[argc-1]);
+	else if(playback_test)
+		res = play_test(ctx, argv[argc-2], argv[argc-1], &opt, reject_every);
+	else if(read_binary)
+		res = binary_to_text(ctx, argv[argc-2], argv[argc-1]) < 0;
 	else
-		save_events(argv[argc-1], track_mask);
-	
-	delete[] file_buf;
-	return 0;
+	{
+		if(threads > 0) ctx->threads = threads;
+		res = convert_file(ctx, argv[argc-2], argv[argc-1], &opt, NULL) < 0;
+	}
+	log_close();
+	parser_free(ctx);
+	delete ctx;
+	return res;
 }